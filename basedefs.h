@@ -145,8 +145,28 @@ public:
         baseptr = NULL;
         Ne = Me = 0;
     }
-    int size() { 
-        return this->Ne; 
+    /* change the number of elements to n, new elements are default constructed. */
+    /* Unlike append(), the storage is allocated in one go, which is much faster */
+    /* when the final size is already known. */
+    bool resize(int n) {
+        if (n < 0) return false;
+        if (n > Me) {
+            T* p = (T*)realloc(baseptr, sizeof(T) * n);
+            if (p == NULL) return false;
+            baseptr = p;
+            Me = n;
+        }
+        for (int i = n; i < Ne; i++) { /* shrink */
+            this->baseptr[i].~T();
+        }
+        for (int i = Ne; i < n; i++) { /* grow */
+            new (&(this->baseptr[i])) T();
+        }
+        Ne = n;
+        return true;
+    }
+    int size() {
+        return this->Ne;
     }
     T* data() { return baseptr; }
     bool isEmpty() { return (this->Ne == 0); }
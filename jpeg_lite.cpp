@@ -1,4 +1,37 @@
 #include "jpeg_lite.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+/* SIMD kernels for the float IDCT (not used with double precision REAL) */
+#if !defined(LINALG_USE_DOUBLE_PRECISION) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define _JPEG_USE_SSE2
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define _JPEG_USE_AVX
+#include <immintrin.h>
+#endif
+#endif
+
+/* memory mapped file IO for jpeg_read_mmap() */
+#if defined(_MSC_VER)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* trace of the markers parsed, only printed by debug builds (as debugCheck() in basedefs.h) */
+#if defined(_DEBUG) || defined(DEBUG) || defined(DEBUG_MODE)
+#define _JPEG_DEBUG_PRINT(...) printf(__VA_ARGS__)
+#else
+#define _JPEG_DEBUG_PRINT(...)
+#endif
 
 /* JPEG markers, reference: https://www.disktuna.com/list-of-jpeg-markers/ */
 /* JPEG specification uses "markers" to tell what type of data that is coming next, */
@@ -109,6 +142,12 @@ struct JPEG_MCU {
     REAL_8x8 Y0, Y1, Y2, Y3, Cb, Cr;
 };
 
+/* structure used to store quantized coefficients decoded from the Huffman bitstream */
+struct JPEG_MCU_COEFF {
+    INT_8x8 Y0, Y1, Y2, Y3, Cb, Cr;
+    int Y0_last, Y1_last, Y2_last, Y3_last, Cb_last, Cr_last; /* zigzag index of the last nonzero coefficient of each block */
+};
+
 /* structure used to store quantized coefficients */
 struct JPEG_MCU_QCOEFF {
     INT_8x8 Y0, Y1, Y2, Y3, Cb, Cr;
@@ -293,7 +332,8 @@ INT_8x8 _jpeg_quantize_real8x8(REAL_8x8 * a, INT_8x8 * q)
     return c;
 }
 
-bool alloc_image(int w, int h, RAW_IMAGE ** image)
+/* allocate an image, "clear" fills it with zeros (not needed if every pixel will be written) */
+bool _jpeg_alloc_image(int w, int h, RAW_IMAGE ** image, bool clear)
 {
     if (w < 1 || h < 1) {
         *image = NULL;
@@ -321,14 +361,21 @@ bool alloc_image(int w, int h, RAW_IMAGE ** image)
     }
     else {
         /* success, clear trash data */
-        memset(p->r, 0, channel_bytes);
-        memset(p->g, 0, channel_bytes);
-        memset(p->b, 0, channel_bytes);
+        if (clear) {
+            memset(p->r, 0, channel_bytes);
+            memset(p->g, 0, channel_bytes);
+            memset(p->b, 0, channel_bytes);
+        }
         *image = p;
         return true;
     }
 }
 
+bool alloc_image(int w, int h, RAW_IMAGE ** image)
+{
+    return _jpeg_alloc_image(w, h, image, true);
+}
+
 bool free_image(RAW_IMAGE * image)
 {
     if (image == NULL)
@@ -610,53 +657,81 @@ bool _jpeg_write_fp(FILE* fp, int bytes, void * buffer) {
     return true;
 }
 
-/* dump message when loading */
-void _jpeg_dump_message(JPEG_FILE* jfile, const char* message) {
+/* JPEG data held in memory, markers are parsed directly from it */
+struct JPEG_STREAM {
+    const BYTE* data; /* JPEG data (the whole file) */
+    int size;         /* size of the data in bytes */
+    int pos;          /* current read position */
+};
+
+bool _jpeg_read_stream(JPEG_STREAM* stream, int bytes, void * buffer)
+{
+    if (bytes <= 0) {
+        return false;
+    }
+    if (bytes > stream->size - stream->pos) {
+        memset(buffer, 0, bytes); /* out of data */
+        stream->pos = stream->size;
+        return false;
+    }
+    memcpy(buffer, stream->data + stream->pos, bytes);
+    stream->pos += bytes;
+    return true;
+}
+
+/* append message to a message buffer of _JPEG_MSG_LEN bytes */
+void _jpeg_append_message(char* buffer, const char* message) {
     /* concatenate message */
-    int istart = strlen(jfile->message), iend = _JPEG_MSG_LEN - 1;
-    int icur, j = 0;
-    for (icur = istart; icur < iend; icur++, j++) {
-        jfile->message[icur] = message[j];
+    int icur = strlen(buffer), iend = _JPEG_MSG_LEN - 1;
+    for (int j = 0; icur < iend && message[j] != '\0'; icur++, j++) {
+        buffer[icur] = message[j];
     }
-    jfile->message[icur + 1] = '\0';
+    buffer[icur] = '\0';
+}
+
+/* dump message when loading */
+void _jpeg_dump_message(JPEG_FILE* jfile, const char* message) {
+    _jpeg_append_message(jfile->message, message);
 }
 
 /* JPEG marker read functions */
 /* JPEG read unknown marker (do nothing) */
-bool _jpeg_read_NONE(FILE* fp, JPEG_FILE* jfile) {
+bool _jpeg_read_NONE(JPEG_STREAM* stream, JPEG_FILE* jfile) {
     BYTE buffer[16];
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
-    /* we dont care what is in this marker so we just read it and do nothing. */
-    for (int i = 0; i < length; i++) {
-        _jpeg_read_fp(fp, 1, buffer);
+    /* we dont care what is in this marker so we just skip it. */
+    if (length < 0 || length > stream->size - stream->pos) {
+        stream->pos = stream->size;
+        return false;
     }
+    stream->pos += length;
     return true;
 }
-bool _jpeg_read_APPN(FILE* fp, JPEG_FILE* jfile) {
-    return _jpeg_read_NONE(fp, jfile);
+bool _jpeg_read_APPN(JPEG_STREAM* stream, JPEG_FILE* jfile) {
+    return _jpeg_read_NONE(stream, jfile);
 }
 /* JPEG read comment */
-bool _jpeg_read_COM(FILE* fp, JPEG_FILE* jfile) {
-    return _jpeg_read_NONE(fp, jfile);
+bool _jpeg_read_COM(JPEG_STREAM* stream, JPEG_FILE* jfile) {
+    return _jpeg_read_NONE(stream, jfile);
 }
 /* JPEG read JPG0~13 */
-bool _jpeg_read_JPGN(FILE* fp, JPEG_FILE* jfile) {
-    return _jpeg_read_NONE(fp, jfile);
+bool _jpeg_read_JPGN(JPEG_STREAM* stream, JPEG_FILE* jfile) {
+    return _jpeg_read_NONE(stream, jfile);
 }
 /* JPEG read quantization tables */
-bool _jpeg_read_QTAB(FILE* fp, JPEG_FILE* jfile) {
+bool _jpeg_read_QTAB(JPEG_STREAM* stream, JPEG_FILE* jfile) {
     BYTE buffer[16];
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
 
     while (length > 0) {
         BYTE tabInfo;
-        _jpeg_read_fp(fp, 1, &tabInfo);
+        _jpeg_read_stream(stream, 1, &tabInfo);
         length -= 1;
         BYTE tabID, tabBits;
         tabID = (tabInfo & 0x0F);
@@ -670,8 +745,8 @@ bool _jpeg_read_QTAB(FILE* fp, JPEG_FILE* jfile) {
             /* read 16 bit quantization table */
             for (int u = 0; u < 8; u++) {
                 for (int v = 0; v < 8; v++) {
-                    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-                    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+                    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+                    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
                     UINT value = ((UINT(buffer[0]) << 8) | UINT(buffer[1]));
                     qtabz[u * 8 + v] = int(value);
                 }
@@ -682,7 +757,7 @@ bool _jpeg_read_QTAB(FILE* fp, JPEG_FILE* jfile) {
             /* read 8 bit quantization table */
             for (int u = 0; u < 8; u++) {
                 for (int v = 0; v < 8; v++) {
-                    _jpeg_read_fp(fp, 1, buffer);
+                    _jpeg_read_stream(stream, 1, buffer);
                     qtabz[u * 8 + v] = int(buffer[0]);
                 }
             }
@@ -690,6 +765,7 @@ bool _jpeg_read_QTAB(FILE* fp, JPEG_FILE* jfile) {
         }
         /* convert zig-zag quantization table into 8x8 matrix */
         _jpeg_zz_intarr_to_int8x8(qtabz, &(jfile->qtabs[tabID]));
+        jfile->qtab_bits[tabID] = tabBits;
     }
 
     //print_int8x8(jfile->qtabs);
@@ -697,11 +773,11 @@ bool _jpeg_read_QTAB(FILE* fp, JPEG_FILE* jfile) {
     return true;
 
 }
-bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
+bool _jpeg_read_SOF0(JPEG_STREAM* stream, JPEG_FILE* jfile) {
     BYTE buffer[16];
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
 
     /*
@@ -721,20 +797,20 @@ bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
     */
 
     /* read precision (must be 8) */
-    _jpeg_read_fp(fp, 1, buffer);
+    _jpeg_read_stream(stream, 1, buffer);
     if (buffer[0] != 8) {
         _jpeg_dump_message(jfile, "invalid precision setting in JPEG file, precision must be 8 bits.");
         return false;
     }
 
     /* read image height */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int image_height = ((int(buffer[0]) << 8) | int(buffer[1]));
 
     /* read image width */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int image_width = ((int(buffer[0]) << 8) | int(buffer[1]));
 
     if (image_width <= 0 || image_height <= 0) {
@@ -743,7 +819,7 @@ bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
     }
 
     /* read number of channels */
-    _jpeg_read_fp(fp, 1, buffer);
+    _jpeg_read_stream(stream, 1, buffer);
     int num_channels = int(buffer[0]);
     if (num_channels == 4) {
         _jpeg_dump_message(jfile, "unsupported CMYK channel format.");
@@ -761,26 +837,26 @@ bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
     /* guess channel start index, some JPEG image use channel 0 as start index,
        that is not correct but we still need to try our best to read the image */
     bool zero_start = false; /* default */
-    int foffset = ftell(fp);
+    int foffset = stream->pos;
     for (int i = 0; i < num_channels; i++) {
-        _jpeg_read_fp(fp, 1, buffer);
+        _jpeg_read_stream(stream, 1, buffer);
         int channelID = int(buffer[0]);
         if (channelID == 0) {
             zero_start = true;
             break; /* we found a channel with ID == 0 */
         }
-        _jpeg_read_fp(fp, 2, buffer); /* skip 2 bytes */
+        _jpeg_read_stream(stream, 2, buffer); /* skip 2 bytes */
     }
 
     jfile->zero_start = zero_start;
 
-    /* restore file pointer */
-    fseek(fp, foffset, SEEK_SET);
+    /* restore read position */
+    stream->pos = foffset;
 
     /* read each channel */
     for (int i = 0; i < num_channels; i++) {
         /* read and check channel ID */
-        _jpeg_read_fp(fp, 1, buffer);
+        _jpeg_read_stream(stream, 1, buffer);
         int channelID = int(buffer[0]);
         if (zero_start)
             channelID += 1; /* convert to valid channel ID that starts with 1 */
@@ -801,12 +877,12 @@ bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
         jchannel->is_used = true;
 
         /* read sampling factors */
-        _jpeg_read_fp(fp, 1, buffer);
+        _jpeg_read_stream(stream, 1, buffer);
         int horizontal_sampling_factor = int(buffer[0] >> 4);
         int vertical_sampling_factor = int(buffer[0] & 0x0F);
 
         /* read quantization table ID */
-        _jpeg_read_fp(fp, 1, buffer);
+        _jpeg_read_stream(stream, 1, buffer);
         int qtab_id = int(buffer[0]);
         if (qtab_id > 3) {
             _jpeg_dump_message(jfile, "invalid quantization table ID.");
@@ -827,18 +903,18 @@ bool _jpeg_read_SOF0(FILE* fp, JPEG_FILE* jfile) {
 
     return true;
 }
-bool _jpeg_read_DRI(FILE* fp, JPEG_FILE* jfile) {
+bool _jpeg_read_DRI(JPEG_STREAM* stream, JPEG_FILE* jfile) {
     BYTE buffer[16];
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
     if (length != 2) {
         _jpeg_dump_message(jfile, "header size incorrect.");
         return false;
     }
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int restart_interval = ((UINT(buffer[0]) << 8) | UINT(buffer[1]));
     if (restart_interval < 0) {
         _jpeg_dump_message(jfile, "invalid DC coefficient restart interval.");
@@ -847,16 +923,16 @@ bool _jpeg_read_DRI(FILE* fp, JPEG_FILE* jfile) {
     jfile->restart_interval = restart_interval;
     return true;
 }
-bool _jpeg_read_DHT(FILE* fp, JPEG_FILE* jfile) {
+bool _jpeg_read_DHT(JPEG_STREAM* stream, JPEG_FILE* jfile) {
     BYTE buffer[16];
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
 
     while (length > 0) {
         /* read table info */
-        _jpeg_read_fp(fp, 1, buffer);
+        _jpeg_read_stream(stream, 1, buffer);
         BYTE htab_id = (buffer[0] & 0x0F);
         BYTE htab_type = (buffer[0] >> 4); /* 0: DC, 1: AC */
         if (htab_id > 3) {
@@ -876,7 +952,7 @@ bool _jpeg_read_DHT(FILE* fp, JPEG_FILE* jfile) {
         jhtab->offsets[0] = 0;
         int symbols_used = 0; /* total # of symbols used */
         for (int i = 1; i <= 16; i++) {
-            _jpeg_read_fp(fp, 1, buffer);
+            _jpeg_read_stream(stream, 1, buffer);
             symbols_used += int(buffer[0]);
             jhtab->offsets[i] = symbols_used;
         }
@@ -885,7 +961,7 @@ bool _jpeg_read_DHT(FILE* fp, JPEG_FILE* jfile) {
             return false;
         }
         for (int i = 0; i < symbols_used; i++) {
-            _jpeg_read_fp(fp, 1, buffer);
+            _jpeg_read_stream(stream, 1, buffer);
             jhtab->symbols[i] = buffer[0];
         }
         length = length - 1 - 16 - symbols_used;
@@ -896,37 +972,81 @@ bool _jpeg_read_DHT(FILE* fp, JPEG_FILE* jfile) {
     }
     return true;
 }
-bool _jpeg_read_SOS(FILE* fp, JPEG_FILE* jfile) {
+/*
+scan an entropy-coded segment stored in memory from offset "*pos", returns the size
+of the segment (i.e. the offset of the marker that terminates it), or -1 if no such
+marker is found. Byte stuffing (0xFF00) and restart markers (RST0~7) belong to the
+segment, the offsets of the restart markers are saved in "rst_offsets". When the
+data ends first, "*pos" is where the scan resumes once more data is available.
+*/
+int _jpeg_scan_entropy_segment(const BYTE* data, int size, int* pos, Array<int>* rst_offsets) {
+    while ((*pos) < size) {
+        /* jump directly to the next 0xFF, everything in between is entropy-coded data */
+        const BYTE* p = (const BYTE*)memchr(data + (*pos), 0xFF, size - (*pos));
+        if (p == NULL) {
+            (*pos) = size;
+            return -1;
+        }
+        int i = int(p - data);
+        if (i + 1 >= size) {
+            (*pos) = i; /* the byte after 0xFF is not there yet */
+            return -1;
+        }
+        BYTE next = data[i + 1];
+        if (next == 0x00) { /* 0xFF00, stuffed byte */
+            (*pos) = i + 2;
+        }
+        else if (next >= RST0 && next <= RST7) { /* restart marker */
+            rst_offsets->append(i);
+            (*pos) = i + 2;
+        }
+        else if (next == 0xFF) { /* 0xFFFF, fill bytes */
+            (*pos) = i + 1;
+        }
+        else { /* any other marker ends the segment */
+            return i;
+        }
+    }
+    return -1;
+}
+bool _jpeg_read_SOS(JPEG_STREAM* stream, JPEG_FILE* jfile, bool headers_only) {
 
     BYTE buffer[16];
 
     /* assume big-endian */
-    _jpeg_read_fp(fp, 1, buffer); /* higher 8 bits */
-    _jpeg_read_fp(fp, 1, buffer + 1); /* lower 8 bits */
+    _jpeg_read_stream(stream, 1, buffer); /* higher 8 bits */
+    _jpeg_read_stream(stream, 1, buffer + 1); /* lower 8 bits */
     int length = ((UINT(buffer[0]) << 8) | UINT(buffer[1])) - 2; /* size indicator is 2 bytes so we need to exclude marker length */
 
     /* start of scan, defines the actual data in each MCU */
 
-    for (int i = 0; i < jfile->num_channels; i++) {
-        jfile->channels[i].is_used = false; /* set temporary flag to be false */
-    }
     BYTE num_channels;
-    _jpeg_read_fp(fp, 1, &num_channels);
+    _jpeg_read_stream(stream, 1, &num_channels);
+    if (num_channels == 0 || num_channels > jfile->num_channels) {
+        _jpeg_dump_message(jfile, "invalid number of channels in scan.");
+        return false;
+    }
+    if (!jfile->is_progressive && num_channels != jfile->num_channels) {
+        _jpeg_dump_message(jfile, "sequential JPEGs with several scans are not supported.");
+        return false;
+    }
+    bool in_scan[4] = { false, false, false, false };
     for (int i = 0; i < num_channels; i++) {
         BYTE channel_id;
-        _jpeg_read_fp(fp, 1, &channel_id);
+        _jpeg_read_stream(stream, 1, &channel_id);
         if (jfile->zero_start) channel_id += 1; /* force starts with 1 */
-        if (channel_id > jfile->num_channels) {
+        if (channel_id == 0 || channel_id > jfile->num_channels) {
             _jpeg_dump_message(jfile, "invalid channel ID.");
             return false;
         }
-        JPEG_CHANNEL* jchannel = &(jfile->channels[i]);
-        if (jchannel->is_used) {
+        if (in_scan[channel_id - 1]) {
             _jpeg_dump_message(jfile, "set the same channel twice in a loop.");
             return false;
         }
-        jchannel->is_used = true;
-        _jpeg_read_fp(fp, 1, buffer);
+        in_scan[channel_id - 1] = true;
+        jfile->scan_channels[i] = channel_id - 1;
+        JPEG_CHANNEL* jchannel = &(jfile->channels[channel_id - 1]);
+        _jpeg_read_stream(stream, 1, buffer);
         jchannel->dctab_id = buffer[0] >> 4;
         jchannel->actab_id = (buffer[0] & 0x0F);
         if (jchannel->dctab_id > 3 || jchannel->actab_id > 3) {
@@ -934,71 +1054,53 @@ bool _jpeg_read_SOS(FILE* fp, JPEG_FILE* jfile) {
             return false;
         }
     }
-    _jpeg_read_fp(fp, 1, buffer);
-    _jpeg_read_fp(fp, 1, buffer);
-    _jpeg_read_fp(fp, 1, buffer);
-
-    /* then read Huffman encoded bitstream */
-    BYTE highbyte, lowbyte;
-    if (!_jpeg_read_fp(fp, 1, &highbyte) || !_jpeg_read_fp(fp, 1, &lowbyte)) {
+    jfile->scan_num_channels = num_channels;
+    /* spectral selection and successive approximation (progressive JPEGs) */
+    _jpeg_read_stream(stream, 1, buffer);
+    jfile->scan_start = buffer[0];
+    _jpeg_read_stream(stream, 1, buffer);
+    jfile->scan_end = buffer[0];
+    if (!_jpeg_read_stream(stream, 1, buffer)) {
         _jpeg_dump_message(jfile, "unexpected end of file.");
         return false;
     }
-    while (true) {
-        /* checking if two bytes means a marker */
-        if (highbyte == 0xFF) {
-            if (lowbyte == EOI) { /* 0xFFD9 */
-                return true; /* successfully read */
-            }
-            else if (lowbyte == 0x00) { /* 0xFF00 */
-                /* put a 0xFF into bitstream and ignore 0x00 */
-                BYTE data = 0xFF;
-                jfile->hstream.append(data);
-                if (!_jpeg_read_fp(fp, 1, &lowbyte)) {
-                    _jpeg_dump_message(jfile, "unexpected end of file.");
-                    return false;
-                }
-            }
-            else if (lowbyte >= RST0 && lowbyte <= RST7) {
-                /* skip restart marker as we already knew restart interval */
-                if (!_jpeg_read_fp(fp, 1, &lowbyte)) {
-                    _jpeg_dump_message(jfile, "unexpected end of file.");
-                    return false;
-                }
-            }
-            else if (lowbyte == 0xFF) { /* 0xFFFF */
-                /* do nothing as multiple 0xFFs in a row means nothing */
-                continue;
-            }
-            else {
-                char buf[128];
-                sprintf(buf, "invalid JPEG marker : '0xFF%02X'.\n", lowbyte);
-                _jpeg_dump_message(jfile, buf);
-                return false;
-            }
-        }
-        else {
-            jfile->hstream.append(highbyte);
-        }
-        /* read another byte from file */
-        highbyte = lowbyte;
-        if (!_jpeg_read_fp(fp, 1, &lowbyte)) {
-            _jpeg_dump_message(jfile, "unexpected end of file.");
-            return false;
-        }
+    jfile->scan_high = buffer[0] >> 4;
+    jfile->scan_low = buffer[0] & 0x0F;
+    jfile->scan_offset = stream->pos;
+    if (headers_only)
+        return true; /* the entropy-coded data is left untouched */
+
+    /* then locate the Huffman encoded bitstream, it is not copied: "hstream" */
+    /* points into the input data and the scanner finds where it ends */
+    const BYTE* segment = stream->data + stream->pos;
+    jfile->rst_offsets.resize(0); /* keep the storage when a JPEG_FILE is reused */
+    int scan_pos = 0;
+    int segment_size = _jpeg_scan_entropy_segment(segment, stream->size - stream->pos, &scan_pos, &(jfile->rst_offsets));
+    if (segment_size < 0) {
+        stream->pos = stream->size; /* the data ends inside the scan */
+        _jpeg_dump_message(jfile, "unexpected end of file.");
+        return false;
+    }
+    BYTE marker = segment[segment_size + 1];
+    /* byte stuffing and restart markers are kept in the bitstream and */
+    /* resolved by the bit reader when decoding */
+    jfile->hstream = segment;
+    jfile->hstream_size = segment_size;
+    if (jfile->is_progressive) {
+        stream->pos += segment_size; /* the markers of the next scan follow */
+        return true;
+    }
+    stream->pos += segment_size + 2; /* continue after the marker */
+    if (marker != EOI) {
+        char buf[128];
+        sprintf(buf, "invalid JPEG marker : '0xFF%02X'.\n", marker);
+        _jpeg_dump_message(jfile, buf);
+        return false;
     }
 
     return true;
 }
 
-VEC3 _jpeg_YCbCr_to_RGB(VEC3 YCbCr) {
-    REAL Y = YCbCr.x, Cb = YCbCr.y, Cr = YCbCr.z;
-    REAL R, G, B;
-    R = Y + REAL(1.402) * Cr + REAL(128);
-    G = Y + REAL(-0.344) * Cb + REAL(-0.714) * Cr + REAL(128);
-    B = Y + REAL(1.772) * Cb + REAL(128);
-    return VEC3(R, G, B);
-}
 VEC3 _jpeg_RGB_to_YCbCr(VEC3 RGB) {
     REAL R = RGB.x - REAL(128), G = RGB.y - REAL(128), B = RGB.z - REAL(128);
     REAL Y, Cb, Cr;
@@ -1035,51 +1137,264 @@ INT_8x8 _jpeg_clamp_int8x8(INT_8x8 * a)
     return c;
 }
 
-/* generate code for each symbol in Huffman table */
-void _jpeg_generate_huffman_codes(JPEG_HUFFMAN_TABLE* htable) {
+/* generate code for each symbol in Huffman table, then build the decoding tables: */
+/* a lookup table resolving every code not longer than _JPEG_HUFF_LOOKAHEAD bits  */
+/* in one step, and canonical maxcode/mincode/valptr arrays for the longer codes.  */
+/* returns false if the code lengths do not form a valid prefix code.             */
+bool _jpeg_generate_huffman_codes(JPEG_HUFFMAN_TABLE* htable) {
     unsigned int code = 0;
     for (int i = 0; i < 16; i++) { /* codes are at most 16 bits long */
         for (int j = htable->offsets[i]; j < htable->offsets[i + 1]; j++) {
             htable->codes[j] = code;
             code++;
         }
+        if (code > (1U << (i + 1)))
+            return false; /* too many codes of length (i + 1) */
         code <<= 1; /* append a zero to current code candidate */
     }
+
+    /* canonical decoding tables, indexed by code length (1~16) */
+    for (int l = 1; l <= 16; l++) {
+        int first = htable->offsets[l - 1], last = htable->offsets[l];
+        htable->valptr[l] = first;
+        if (first < last) {
+            htable->mincode[l] = int(htable->codes[first]);
+            htable->maxcode[l] = int(htable->codes[last - 1]);
+        }
+        else {
+            htable->mincode[l] = 0;
+            htable->maxcode[l] = -1; /* no code has this length */
+        }
+    }
+    htable->maxcode[17] = 0x7FFFFFFF; /* sentinel */
+
+    /* lookahead table: every (_JPEG_HUFF_LOOKAHEAD)-bit pattern that starts */
+    /* with a short code maps to that code's length and symbol */
+    memset(htable->lookup, 0, sizeof(htable->lookup));
+    for (int l = 1; l <= _JPEG_HUFF_LOOKAHEAD; l++) {
+        int fill = 1 << (_JPEG_HUFF_LOOKAHEAD - l);
+        for (int j = htable->offsets[l - 1]; j < htable->offsets[l]; j++) {
+            int base = int(htable->codes[j]) << (_JPEG_HUFF_LOOKAHEAD - l);
+            for (int k = 0; k < fill; k++) {
+                htable->lookup[base + k] = WORD((l << 8) | htable->symbols[j]);
+            }
+        }
+    }
+    return true;
 }
 
-BYTE _jpeg_read_huffman_symbol(Bitstream* bs, JPEG_HUFFMAN_TABLE* htab) {
-    unsigned int code = 0;
-    for (int i = 0; i < 16; i++) {
-        BYTE bit = bs->readBit();
-        if (bit == 0xFF) 
-            return 0xFF; /* bitstream empty */
-        code = (code << 1) | bit;
-        for (int j = htab->offsets[i]; j < htab->offsets[i + 1]; j++) {
-            if (code == htab->codes[j]) {
-                return htab->symbols[j];
+/*
+process-wide cache of built Huffman decoding tables, shared by all images and threads.
+Tables are keyed by a hash of their DHT payload (16 code counts and the symbols), almost
+every encoder writes the standard tables of Annex K so that after the first image they
+are never built again. Cached tables are immutable and live until the process exits.
+Lookups take no lock: a table is complete before "count" is increased to publish it.
+Once the cache is full, other tables are built in the JPEG_FILE of each image.
+*/
+#define _JPEG_HUFF_CACHE_SIZE 64
+
+struct JPEG_HUFFMAN_CACHE {
+    std::mutex lock;                  /* serializes insertions */
+    std::atomic<int> count;           /* number of published tables */
+    unsigned int hashes[_JPEG_HUFF_CACHE_SIZE];
+    const JPEG_HUFFMAN_TABLE* tables[_JPEG_HUFF_CACHE_SIZE];
+};
+
+static JPEG_HUFFMAN_CACHE _jpeg_huffman_cache;
+
+/* FNV-1a hash of the code counts and symbols of a Huffman table */
+static unsigned int _jpeg_hash_huffman_table(const JPEG_HUFFMAN_TABLE* htable) {
+    unsigned int hash = 2166136261U;
+    for (int i = 1; i <= 16; i++)
+        hash = (hash ^ BYTE(htable->offsets[i] - htable->offsets[i - 1])) * 16777619U;
+    for (int i = 0; i < htable->offsets[16]; i++)
+        hash = (hash ^ htable->symbols[i]) * 16777619U;
+    return hash;
+}
+
+/* cached table with the same content as "htable" among the first "count" entries, NULL if none */
+static const JPEG_HUFFMAN_TABLE* _jpeg_find_huffman_table(const JPEG_HUFFMAN_TABLE* htable, unsigned int hash, int count) {
+    for (int i = 0; i < count; i++) {
+        const JPEG_HUFFMAN_TABLE* cached = _jpeg_huffman_cache.tables[i];
+        if (_jpeg_huffman_cache.hashes[i] == hash &&
+            memcmp(cached->offsets, htable->offsets, sizeof(htable->offsets)) == 0 &&
+            memcmp(cached->symbols, htable->symbols, htable->offsets[16]) == 0)
+            return cached;
+    }
+    return NULL;
+}
+
+/*
+decoding tables for the Huffman table "htable" read from a DHT marker: the shared table
+with the same content, or "htable" itself once its codes are generated (the table is
+then added to the cache if there is room). Returns NULL if the table is invalid.
+*/
+static const JPEG_HUFFMAN_TABLE* _jpeg_get_huffman_table(JPEG_HUFFMAN_TABLE* htable) {
+    unsigned int hash = _jpeg_hash_huffman_table(htable);
+    const JPEG_HUFFMAN_TABLE* cached = _jpeg_find_huffman_table(htable, hash,
+        _jpeg_huffman_cache.count.load(std::memory_order_acquire));
+    if (cached != NULL)
+        return cached;
+    if (!_jpeg_generate_huffman_codes(htable))
+        return NULL;
+
+    std::lock_guard<std::mutex> guard(_jpeg_huffman_cache.lock);
+    int count = _jpeg_huffman_cache.count.load(std::memory_order_relaxed);
+    cached = _jpeg_find_huffman_table(htable, hash, count); /* added by another thread meanwhile */
+    if (cached != NULL)
+        return cached;
+    if (count == _JPEG_HUFF_CACHE_SIZE)
+        return htable;
+    JPEG_HUFFMAN_TABLE* table = new JPEG_HUFFMAN_TABLE();
+    if (table == NULL)
+        return htable;
+    (*table) = (*htable);
+    _jpeg_huffman_cache.hashes[count] = hash;
+    _jpeg_huffman_cache.tables[count] = table;
+    _jpeg_huffman_cache.count.store(count + 1, std::memory_order_release);
+    return table;
+}
+
+/*
+bit reader for the entropy-coded segment: the compressed bytes are read as they
+are stored in the file (0xFF00 byte stuffing and RST markers included), and up to
+64 bits are kept in an accumulator that is refilled several bytes at a time.
+When a marker is met the reader stops in front of it and feeds 0-bits instead,
+the same happens at the end of the data.
+*/
+struct JPEG_BIT_READER {
+    const BYTE* data;        /* entropy-coded data */
+    int size;                /* size of the data in bytes */
+    int pos;                 /* next byte to be loaded into the accumulator */
+    unsigned long long acc;  /* bit accumulator, the next bit to read is the MSB */
+    int bits;                /* number of bits in the accumulator */
+    int padding;             /* how many of these bits are padded 0-bits (always the last ones) */
+    int padded;              /* total number of 0-bits padded so far */
+    int marker;              /* marker code the reader stopped at (0 if none) */
+    bool overrun;            /* true if bits beyond the end of the data were consumed */
+};
+
+void _jpeg_bit_reader_init(JPEG_BIT_READER* br, const BYTE* data, int size) {
+    br->data = data;
+    br->size = size;
+    br->pos = 0;
+    br->acc = 0;
+    br->bits = 0;
+    br->padding = 0;
+    br->padded = 0;
+    br->marker = 0;
+    br->overrun = false;
+}
+
+/* refill the accumulator so that it holds at least 57 bits */
+void _jpeg_bit_reader_fill(JPEG_BIT_READER* br) {
+    /* fast path: load several bytes at once if none of them is 0xFF */
+    if (br->marker == 0 && br->pos + 8 <= br->size) {
+        const BYTE* p = br->data + br->pos;
+        unsigned long long w = 0;
+        for (int i = 0; i < 8; i++)
+            w = (w << 8) | p[i];
+        unsigned long long nw = ~w; /* a 0xFF byte in "w" is a zero byte in "nw" */
+        if (((nw - 0x0101010101010101ULL) & ~nw & 0x8080808080808080ULL) == 0) {
+            int nbytes = (63 - br->bits) >> 3;
+            br->acc |= (w >> (64 - nbytes * 8)) << (64 - br->bits - nbytes * 8);
+            br->bits += nbytes * 8;
+            br->pos += nbytes;
+            return;
+        }
+    }
+    /* slow path: byte by byte, resolving byte stuffing and markers */
+    while (br->bits <= 56) {
+        unsigned long long b = 0;
+        if (br->marker == 0 && br->pos < br->size) {
+            b = br->data[br->pos];
+            if (b == 0xFF) {
+                int next = (br->pos + 1 < br->size) ? int(br->data[br->pos + 1]) : int(EOI);
+                if (next == 0x00) { /* 0xFF00, stuffed byte */
+                    br->pos += 2;
+                }
+                else if (next == 0xFF) { /* fill byte, ignore it */
+                    br->pos++;
+                    continue;
+                }
+                else { /* marker, stop in front of it */
+                    br->marker = next;
+                    b = 0;
+                    br->padding += 8;
+                    br->padded += 8;
+                }
             }
+            else {
+                br->pos++;
+            }
+        }
+        else {
+            br->padding += 8; /* no more data */
+            br->padded += 8;
+        }
+        br->acc |= b << (56 - br->bits);
+        br->bits += 8;
+    }
+}
+
+/* look at the next n (<=32) bits without consuming them */
+inline unsigned int _jpeg_bit_reader_peek(JPEG_BIT_READER* br, int n) {
+    if (br->bits < n)
+        _jpeg_bit_reader_fill(br);
+    return (unsigned int)(br->acc >> (64 - n));
+}
+
+/* consume n bits, n must not be larger than the number of bits peeked */
+inline void _jpeg_bit_reader_consume(JPEG_BIT_READER* br, int n) {
+    br->acc <<= n;
+    br->bits -= n;
+    if (br->bits < br->padding) { /* part of the padding has been consumed */
+        br->padding = br->bits;
+        br->overrun = true;
+    }
+}
+
+/* read n (<=16) bits */
+inline int _jpeg_bit_reader_get(JPEG_BIT_READER* br, int n) {
+    if (n == 0) return 0;
+    int v = int(_jpeg_bit_reader_peek(br, n));
+    _jpeg_bit_reader_consume(br, n);
+    return v;
+}
+
+BYTE _jpeg_read_huffman_symbol(JPEG_BIT_READER* br, const JPEG_HUFFMAN_TABLE* htab) {
+    /* fast path: codes not longer than _JPEG_HUFF_LOOKAHEAD bits */
+    WORD entry = htab->lookup[_jpeg_bit_reader_peek(br, _JPEG_HUFF_LOOKAHEAD)];
+    if (entry != 0) {
+        _jpeg_bit_reader_consume(br, entry >> 8);
+        return BYTE(entry & 0xFF);
+    }
+    /* slow path: longer codes are resolved with the canonical code tables */
+    unsigned int bits = _jpeg_bit_reader_peek(br, 16);
+    for (int l = _JPEG_HUFF_LOOKAHEAD + 1; l <= 16; l++) {
+        int code = int(bits >> (16 - l));
+        if (code <= htab->maxcode[l]) {
+            _jpeg_bit_reader_consume(br, l);
+            return htab->symbols[htab->valptr[l] + code - htab->mincode[l]];
         }
     }
     return 0xFF; /* code not found */
 }
 
-bool _jpeg_decode_DCT_coeffs(JPEG_FILE* jfile, Bitstream* bit_reader, REAL_8x8* DCT_coeffs, int* prev_DC_coeff,
-    JPEG_HUFFMAN_TABLE* dctab, JPEG_HUFFMAN_TABLE* actab) {
+/* decode the coefficients of a block, "last_nonzero" receives the zigzag index of the last nonzero AC coefficient (0 if none) */
+bool _jpeg_decode_DCT_coeffs(char* message, JPEG_BIT_READER* bit_reader, INT_8x8* DCT_coeffs, int* last_nonzero,
+    int* prev_DC_coeff, const JPEG_HUFFMAN_TABLE* dctab, const JPEG_HUFFMAN_TABLE* actab) {
 
     if (DCT_coeffs == nullptr) return false;
 
     BYTE length = _jpeg_read_huffman_symbol(bit_reader, dctab);
     if (length > 11) {
-        _jpeg_dump_message(jfile, "invalid Huffman table symbol.");
+        _jpeg_append_message(message, "invalid Huffman table symbol.");
         return false; /* includes 0xFF */
     }
 
-    int coeff = (int)(bit_reader->readBits(length));
+    int coeff = _jpeg_bit_reader_get(bit_reader, length);
     /* if length == 0, then coeff = 0, that is the only way we obtain 0 as coefficient. */
-    if (coeff == -1) {
-        _jpeg_dump_message(jfile, "invalid DC coefficient.");
-        return false;
-    }
     /* determine if the coefficient is negative */
     if (length != 0 && coeff < (1 << (length - 1))) {
         coeff -= (1 << length) - 1;
@@ -1093,17 +1408,17 @@ bool _jpeg_decode_DCT_coeffs(JPEG_FILE* jfile, Bitstream* bit_reader, REAL_8x8*
 
     /* fill 63 AC coefficients */
     int i = 1;
+    int last = 0;
     while (i < 64) {
         BYTE symbol = _jpeg_read_huffman_symbol(bit_reader, actab);
         if (symbol == 0xFF) { /* invalid symbol */
-            _jpeg_dump_message(jfile, "invalid Huffman table symbol.");
+            _jpeg_append_message(message, "invalid Huffman table symbol.");
             return false;
         }
         else if (symbol == 0x00) { /* symbol 0x00 means all the rest components are 0 */
             for (int j = i; j < 64; j++)
                 coeffs[j] = 0;
-            _jpeg_zz_intarr_to_real8x8(coeffs, DCT_coeffs);
-            return true;
+            break;
         }
         else {
             BYTE nZ = (symbol >> 4);
@@ -1115,276 +1430,1549 @@ bool _jpeg_decode_DCT_coeffs(JPEG_FILE* jfile, Bitstream* bit_reader, REAL_8x8*
 
             /* now we are going to add zeros to the end of the coefficients */
             if (i + nZ >= 64) {
-                _jpeg_dump_message(jfile, "DCT coefficients is more than 64.");
+                _jpeg_append_message(message, "DCT coefficients is more than 64.");
                 return false; /* out of range */
             }
             for (int j = 0; j < nZ; i++, j++) coeffs[i] = 0;
 
             if (coeff_len > 10) {
-                _jpeg_dump_message(jfile, "AC coefficients can only have 10 bits length at maximum.");
+                _jpeg_append_message(message, "AC coefficients can only have 10 bits length at maximum.");
                 return false;
             }
 
             if (coeff_len != 0) { /* exclude 0xF0 */
-                coeff = bit_reader->readBits(coeff_len);
-                if (coeff == -1) {
-                    _jpeg_dump_message(jfile, "invalid AC coefficient.");
-                    return false;
-                }
+                coeff = _jpeg_bit_reader_get(bit_reader, coeff_len);
                 if (coeff < (1 << (coeff_len - 1))) {
                     coeff -= (1 << coeff_len) - 1;
                 }
-                coeffs[i] = coeff;
+                coeffs[i] = coeff; /* never 0 here */
+                last = i;
                 i++;
             }
         }
     }
-    _jpeg_zz_intarr_to_real8x8(coeffs, DCT_coeffs);
+    if (bit_reader->overrun) {
+        _jpeg_append_message(message, "unexpected end of Huffman bitstream.");
+        return false;
+    }
+    _jpeg_zz_intarr_to_int8x8(coeffs, DCT_coeffs);
+    (*last_nonzero) = last;
     return true;
 }
 
-/* decode all the Huffman bitstream and fill them into all MCUs */
-bool _jpeg_decode_MCUs(JPEG_FILE* jfile, int nW, int nH, JPEG_MCU* MCUs, int subsampling_type) {
-    /* pointer to MCUs should be a valid contiguous memory space */
+/* parse the Huffman symbols of a block only to skip them, the coefficients are not reconstructed */
+bool _jpeg_skip_DCT_coeffs(char* message, JPEG_BIT_READER* bit_reader, const JPEG_HUFFMAN_TABLE* dctab, const JPEG_HUFFMAN_TABLE* actab) {
 
-    /* decode MCU array */
-    Bitstream bit_reader;
-    bit_reader.load(jfile->hstream);
-    int prev_DC_coeffs[4] = { 0 }; /* 4 channels at most */
-    for (int i = 0; i < nW * nH; i++) { /* for each MCU in raster scan order */
-        if (jfile->restart_interval != 0 && (i % jfile->restart_interval == 0)) {
-            prev_DC_coeffs[0] = prev_DC_coeffs[1] = prev_DC_coeffs[2] = 0;
-            bit_reader.alignRead();
-        }
-        if (subsampling_type == 1) { /* no subsampling */
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y0), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
+    BYTE length = _jpeg_read_huffman_symbol(bit_reader, dctab);
+    if (length > 11) {
+        _jpeg_append_message(message, "invalid Huffman table symbol.");
+        return false; /* includes 0xFF */
+    }
+    _jpeg_bit_reader_get(bit_reader, length);
+
+    int i = 1;
+    while (i < 64) {
+        BYTE symbol = _jpeg_read_huffman_symbol(bit_reader, actab);
+        if (symbol == 0xFF) { /* invalid symbol */
+            _jpeg_append_message(message, "invalid Huffman table symbol.");
+            return false;
         }
-        else if (subsampling_type == 2 || subsampling_type == 3) { /* h/v subsampling */
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y0), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y1), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
+        else if (symbol == 0x00) { /* end of block */
+            break;
         }
-        else { /* h&v subsampling */
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y0), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y1), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y2), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
-            if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Y3), &(prev_DC_coeffs[0]),
-                &(jfile->dctabs[jfile->channels[0].dctab_id]), &(jfile->actabs[jfile->channels[0].actab_id])))
-                return false;
+        BYTE nZ = (symbol == 0xF0) ? 16 : (symbol >> 4);
+        BYTE coeff_len = (symbol & 0x0F);
+        if (i + nZ >= 64) {
+            _jpeg_append_message(message, "DCT coefficients is more than 64.");
+            return false; /* out of range */
         }
-        if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Cb), &(prev_DC_coeffs[1]),
-            &(jfile->dctabs[jfile->channels[1].dctab_id]), &(jfile->actabs[jfile->channels[1].actab_id])))
+        if (coeff_len > 10) {
+            _jpeg_append_message(message, "AC coefficients can only have 10 bits length at maximum.");
             return false;
-        if (!_jpeg_decode_DCT_coeffs(jfile, &bit_reader, &(MCUs[i].Cr), &(prev_DC_coeffs[2]),
-            &(jfile->dctabs[jfile->channels[2].dctab_id]), &(jfile->actabs[jfile->channels[2].actab_id])))
-            return false;
-    }
-    return true;
-}
-
-bool _jpeg_dequantize_MCUs(JPEG_FILE* jfile, int nW, int nH, JPEG_MCU* MCUs, int subsampling_type) {
-    for (int i = 0; i < nW * nH; i++) { /* for each MCU in raster scan order */
-        if (subsampling_type >= 1) {
-            MCUs[i].Y0 = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Y0), &(jfile->qtabs[jfile->channels[0].qtab_id]));
         }
-        if (subsampling_type >= 2) {
-            MCUs[i].Y1 = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Y1), &(jfile->qtabs[jfile->channels[0].qtab_id]));
+        i += nZ;
+        if (coeff_len != 0) {
+            _jpeg_bit_reader_get(bit_reader, coeff_len);
+            i++;
         }
-        if (subsampling_type >= 4) {
-            MCUs[i].Y2 = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Y2), &(jfile->qtabs[jfile->channels[0].qtab_id]));
-            MCUs[i].Y3 = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Y3), &(jfile->qtabs[jfile->channels[0].qtab_id]));
-        }
-        MCUs[i].Cb = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Cb), &(jfile->qtabs[jfile->channels[1].qtab_id]));
-        MCUs[i].Cr = _jpeg_real8x8_mul_int8x8(&(MCUs[i].Cr), &(jfile->qtabs[jfile->channels[2].qtab_id]));
+    }
+    if (bit_reader->overrun) {
+        _jpeg_append_message(message, "unexpected end of Huffman bitstream.");
+        return false;
     }
     return true;
 }
 
-/* apply IDCT to dequantized MCUs, to obtain the actual Y, Cb and Cr values */
-bool _jpeg_IDCT_MCUs(int nW, int nH, JPEG_MCU* MCUs, int subsampling_type) {
-
-    for (int i = 0; i < nW * nH; i++) { /* for each MCU in raster scan order */
-        if (subsampling_type >= 1)
-            IDCT8x8_fast(&(MCUs[i].Y0));
-        if (subsampling_type >= 2)
-            IDCT8x8_fast(&(MCUs[i].Y1));
-        if (subsampling_type >= 4) {
-            IDCT8x8_fast(&(MCUs[i].Y2));
-            IDCT8x8_fast(&(MCUs[i].Y3));
-        }
-        IDCT8x8_fast(&(MCUs[i].Cb));
-        IDCT8x8_fast(&(MCUs[i].Cr));
+/*
+decode the Huffman bitstream of a single MCU. Grayscale images (subsampling_type 0) only
+have a luminance block, with "luma_only" the chrominance blocks are skipped.
+*/
+bool _jpeg_decode_MCU(JPEG_FILE* jfile, char* message, JPEG_BIT_READER* bit_reader, int* prev_DC_coeffs,
+    JPEG_MCU_COEFF* MCU, int subsampling_type, bool luma_only) {
+    if (subsampling_type == 0 || subsampling_type == 1) { /* grayscale or no subsampling */
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y0), &(MCU->Y0_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+    }
+    else if (subsampling_type == 2 || subsampling_type == 3) { /* h/v subsampling */
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y0), &(MCU->Y0_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y1), &(MCU->Y1_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+    }
+    else { /* h&v subsampling */
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y0), &(MCU->Y0_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y1), &(MCU->Y1_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y2), &(MCU->Y2_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
+        if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Y3), &(MCU->Y3_last), &(prev_DC_coeffs[0]),
+            jfile->dctab_decode[jfile->channels[0].dctab_id], jfile->actab_decode[jfile->channels[0].actab_id]))
+            return false;
     }
+    if (subsampling_type == 0)
+        return true;
+    if (luma_only) {
+        return _jpeg_skip_DCT_coeffs(message, bit_reader,
+            jfile->dctab_decode[jfile->channels[1].dctab_id], jfile->actab_decode[jfile->channels[1].actab_id]) &&
+            _jpeg_skip_DCT_coeffs(message, bit_reader,
+            jfile->dctab_decode[jfile->channels[2].dctab_id], jfile->actab_decode[jfile->channels[2].actab_id]);
+    }
+    if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Cb), &(MCU->Cb_last), &(prev_DC_coeffs[1]),
+        jfile->dctab_decode[jfile->channels[1].dctab_id], jfile->actab_decode[jfile->channels[1].actab_id]))
+        return false;
+    if (!_jpeg_decode_DCT_coeffs(message, bit_reader, &(MCU->Cr), &(MCU->Cr_last), &(prev_DC_coeffs[2]),
+        jfile->dctab_decode[jfile->channels[2].dctab_id], jfile->actab_decode[jfile->channels[2].actab_id]))
+        return false;
     return true;
 }
 
-bool _jpeg_decode_color(JPEG_FILE* jfile, int nW, int nH, JPEG_MCU* MCUs, int subsampling_type, RAW_IMAGE** image_ptr)
-{
-    FixedArray2D<BYTE> image_plane[3]; /* R,G,B */
-    FixedArray2D<BYTE> MCU_plane[3]; /* R,G,B */
-
-    int MCU_width, MCU_height;
-
-    /* create image and MCU plane */
-
-    if (subsampling_type == 1) { MCU_width = 8; MCU_height = 8; }
-    else if (subsampling_type == 2) { MCU_width = 16; MCU_height = 8; }
-    else if (subsampling_type == 3) { MCU_width = 8; MCU_height = 16; }
-    else { MCU_width = 16; MCU_height = 16; }
-
-    image_plane[0].create(jfile->image_width, jfile->image_height);
-    image_plane[1].create(jfile->image_width, jfile->image_height);
-    image_plane[2].create(jfile->image_width, jfile->image_height);
-    MCU_plane[0].create(MCU_width, MCU_height);
-    MCU_plane[1].create(MCU_width, MCU_height);
-    MCU_plane[2].create(MCU_width, MCU_height);
+/*
+fixed-point AAN IDCT. The scale factors of the AAN algorithm are folded into
+the quantization table (see _jpeg_prepare_IDCT_table), so dequantization
+costs nothing. The values are 32-bit integers:
+  * scaled quantization table:  _JPEG_IDCT_QTAB_BITS fraction bits
+  * intermediate values:        _JPEG_IDCT_FRAC_BITS fraction bits
+  * multipliers:                _JPEG_IDCT_CONST_BITS fraction bits
+which keeps the error within the IEEE 1180 limits.
+The products (dequantization and multipliers) are done on 64 bits and the
+dequantized coefficients are clamped to +-2^_JPEG_IDCT_MAX_BITS, so that no
+value can overflow whatever the input, 16-bit quantization tables and corrupt
+data included: the intermediate values are at most 130 times the largest
+coefficient, below 2^31. Valid images never reach the clamp (their
+dequantized coefficients are below 2^18, with the fraction bits).
+A 16-bit quantization table entry still fits in the scaled table (65535 x
+1.93 x 2^14 < 2^31).
+*/
+#define _JPEG_IDCT_QTAB_BITS  14
+#define _JPEG_IDCT_FRAC_BITS  6
+#define _JPEG_IDCT_CONST_BITS 10
+#define _JPEG_IDCT_MAX_BITS   23
+
+const int _IDCT_FIX_1_414213562 = 1448; /* round(1.414213562 * 2^10) */
+const int _IDCT_FIX_1_847759065 = 1892; /* round(1.847759065 * 2^10) */
+const int _IDCT_FIX_1_082392200 = 1108; /* round(1.082392200 * 2^10) */
+const int _IDCT_FIX_2_613125930 = 2676; /* round(2.613125930 * 2^10) */
+
+#define _IDCT_FIX_MUL(v, c) int(((long long)(v) * (c)) >> _JPEG_IDCT_CONST_BITS)
+
+/* dequantize a coefficient with the scaled quantization table entry "q", clamped (see above) */
+inline int _jpeg_dequantize_fixed(int coeff, int q) {
+    const long long rounding = 1LL << (_JPEG_IDCT_QTAB_BITS - _JPEG_IDCT_FRAC_BITS - 1);
+    const long long limit = 1LL << _JPEG_IDCT_MAX_BITS;
+    long long v = ((long long)coeff * q + rounding) >> (_JPEG_IDCT_QTAB_BITS - _JPEG_IDCT_FRAC_BITS);
+    if (v > limit) return int(limit);
+    if (v < -limit) return int(-limit);
+    return int(v);
+}
 
-    /* convert each MCU and paste to image plane */
+/*
+block size to run the IDCT on, indexed by the zigzag index of the last nonzero
+coefficient: 1 for a DC-only block, otherwise 2, 4 or 8 if all the nonzero
+coefficients are in the top-left 2x2, 4x4 or 8x8 corner of the block
+*/
+const BYTE _jpeg_zz_idct_size[64] = {
+    1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8
+};
 
-    for (int j = 0; j < nH; j++) {
-        for (int i = 0; i < nW; i++) {
+/* 1D AAN IDCT on 8 values that are "stride" ints apart, only the first N (2, 4 or 8) of them can be nonzero */
+template <int N>
+inline void _jpeg_IDCT8_fixed(int* v, int stride) {
+    /* the inputs known to be zero are never read, and the compiler drops their terms */
+    const int v0 = v[0 * stride], v1 = v[1 * stride];
+    const int v2 = (N > 2) ? v[2 * stride] : 0, v3 = (N > 2) ? v[3 * stride] : 0;
+    const int v4 = (N > 4) ? v[4 * stride] : 0, v5 = (N > 4) ? v[5 * stride] : 0;
+    const int v6 = (N > 4) ? v[6 * stride] : 0, v7 = (N > 4) ? v[7 * stride] : 0;
+
+    /* even part */
+    int tmp10 = v0 + v4;
+    int tmp11 = v0 - v4;
+    int tmp13 = v2 + v6;
+    int tmp12 = _IDCT_FIX_MUL(v2 - v6, _IDCT_FIX_1_414213562) - tmp13;
+    int tmp0 = tmp10 + tmp13;
+    int tmp3 = tmp10 - tmp13;
+    int tmp1 = tmp11 + tmp12;
+    int tmp2 = tmp11 - tmp12;
+
+    /* odd part */
+    int z13 = v5 + v3;
+    int z10 = v5 - v3;
+    int z11 = v1 + v7;
+    int z12 = v1 - v7;
+    int tmp7 = z11 + z13;
+    tmp11 = _IDCT_FIX_MUL(z11 - z13, _IDCT_FIX_1_414213562);
+    int z5 = _IDCT_FIX_MUL(z10 + z12, _IDCT_FIX_1_847759065);
+    tmp10 = _IDCT_FIX_MUL(z12, _IDCT_FIX_1_082392200) - z5;
+    tmp12 = z5 - _IDCT_FIX_MUL(z10, _IDCT_FIX_2_613125930);
+    int tmp6 = tmp12 - tmp7;
+    int tmp5 = tmp11 - tmp6;
+    int tmp4 = tmp10 + tmp5;
+
+    v[0 * stride] = tmp0 + tmp7;
+    v[7 * stride] = tmp0 - tmp7;
+    v[1 * stride] = tmp1 + tmp6;
+    v[6 * stride] = tmp1 - tmp6;
+    v[2 * stride] = tmp2 + tmp5;
+    v[5 * stride] = tmp2 - tmp5;
+    v[4 * stride] = tmp3 + tmp4;
+    v[3 * stride] = tmp3 - tmp4;
+}
 
-            /* for each MCU, calculate RGB values based on subsampling type */
+/* fixed-point IDCT of a block whose nonzero coefficients are all in the top-left NxN corner */
+template <int N>
+void _jpeg_IDCT8x8_fixed_NxN(INT_8x8* coeffs, const int* qtab, BYTE* out, int stride) {
+    int block[64]; /* only the entries read by the IDCT below are ever filled */
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j < N; j++)
+            block[i * 8 + j] = _jpeg_dequantize_fixed(coeffs->data[i][j], qtab[i * 8 + j]);
+    /* IDCT for each column, the last 8-N columns are zero and stay zero */
+    for (int i = 0; i < N; i++)
+        _jpeg_IDCT8_fixed<N>(block + i, 8);
+    /* IDCT for each row, then remove the fraction bits and the factor 8 of the AAN algorithm and level shift */
+    const int shift = _JPEG_IDCT_FRAC_BITS + 3;
+    const int descale = (1 << (shift - 1)) + (128 << shift);
+    for (int i = 0; i < 8; i++) {
+        int* row = block + i * 8;
+        _jpeg_IDCT8_fixed<N>(row, 1);
+        for (int j = 0; j < 8; j++)
+            out[i * stride + j] = _jpeg_byte_clamp((row[j] + descale) >> shift);
+    }
+}
 
-            if (subsampling_type == 1) {
-                for (int y = 0; y < 8; y++) {
-                    for (int x = 0; x < 8; x++) {
-                        REAL Y = REAL(MCUs[j*nW + i].Y0.data[y][x]);
-                        REAL Cb = REAL(MCUs[j*nW + i].Cb.data[y][x]);
-                        REAL Cr = REAL(MCUs[j*nW + i].Cr.data[y][x]);
-                        VEC3 RGB = _jpeg_YCbCr_to_RGB(VEC3(Y, Cb, Cr));
-                        MCU_plane[0].at(x, y) = _jpeg_byte_clamp(RGB.x);
-                        MCU_plane[1].at(x, y) = _jpeg_byte_clamp(RGB.y);
-                        MCU_plane[2].at(x, y) = _jpeg_byte_clamp(RGB.z);
-                    }
-                }
-            }
-            else if (subsampling_type == 2) {
-                /* horizontal subsampling (w16 x h8) */
-                for (int y = 0; y < 8; y++) {
-                    for (int x = 0; x < 16; x++) {
-                        REAL Y;
-                        if (x < 8) Y = REAL(MCUs[j*nW + i].Y0.data[y][x]);
-                        else Y = REAL(MCUs[j*nW + i].Y1.data[y][x - 8]);
-                        REAL Cb = REAL(MCUs[j*nW + i].Cb.data[y][x / 2]);
-                        REAL Cr = REAL(MCUs[j*nW + i].Cr.data[y][x / 2]);
-                        MCU_plane[0].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.402) * Cr + 128);
-                        MCU_plane[1].at(x, y) = _jpeg_byte_clamp(Y - REAL(0.344) * Cb - REAL(0.714) * Cr + 128);
-                        MCU_plane[2].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.772) * Cb + 128);
-                    }
-                }
-            }
-            else if (subsampling_type == 3) {
-                /* vertical subsampling (w8 x h16) */
-                for (int y = 0; y < 16; y++) {
-                    for (int x = 0; x < 8; x++) {
-                        REAL Y;
-                        if (y < 8) Y = REAL(MCUs[j*nW + i].Y0.data[y][x]);
-                        else Y = REAL(MCUs[j*nW + i].Y1.data[y - 8][x]);
-                        REAL Cb = REAL(MCUs[j*nW + i].Cb.data[y / 2][x]);
-                        REAL Cr = REAL(MCUs[j*nW + i].Cr.data[y / 2][x]);
-                        MCU_plane[0].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.402) * Cr + 128);
-                        MCU_plane[1].at(x, y) = _jpeg_byte_clamp(Y - REAL(0.344) * Cb - REAL(0.714) * Cr + 128);
-                        MCU_plane[2].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.772) * Cb + 128);
-                    }
-                }
-            }
-            else {
-                /* horizontal and vertical subsampling (w16 x h16) */
-                for (int y = 0; y < 16; y++) {
-                    for (int x = 0; x < 16; x++) {
-                        REAL Y;
-                        if (x < 8 && y < 8) Y = REAL(MCUs[j*nW + i].Y0.data[y][x]);
-                        else if (x >= 8 && y < 8) Y = REAL(MCUs[j*nW + i].Y1.data[y][x - 8]);
-                        else if (x < 8 && y >= 8) Y = REAL(MCUs[j*nW + i].Y2.data[y - 8][x]);
-                        else Y = REAL(MCUs[j*nW + i].Y3.data[y - 8][x - 8]);
-                        REAL Cb = REAL(MCUs[j*nW + i].Cb.data[y / 2][x / 2]);
-                        REAL Cr = REAL(MCUs[j*nW + i].Cr.data[y / 2][x / 2]);
-                        MCU_plane[0].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.402) * Cr + 128);
-                        MCU_plane[1].at(x, y) = _jpeg_byte_clamp(Y - REAL(0.344) * Cb - REAL(0.714) * Cr + 128);
-                        MCU_plane[2].at(x, y) = _jpeg_byte_clamp(Y + REAL(1.772) * Cb + 128);
-                    }
-                }
-            }
+/*
+dequantize and IDCT a block with the fixed-point AAN IDCT, "qtab" is the scaled
+quantization table and "last" the zigzag index of the last nonzero coefficient.
+The level shifted samples are written as bytes to "out", rows are "stride" bytes apart.
+*/
+void _jpeg_IDCT8x8_fixed(INT_8x8* coeffs, int last, const int* qtab, BYTE* out, int stride) {
+    switch (_jpeg_zz_idct_size[last]) {
+    case 1: { /* DC only, the block is flat */
+        const int shift = _JPEG_IDCT_FRAC_BITS + 3;
+        int dc = _jpeg_dequantize_fixed(coeffs->data[0][0], qtab[0]);
+        BYTE value = _jpeg_byte_clamp((dc + (1 << (shift - 1)) + (128 << shift)) >> shift);
+        for (int i = 0; i < 8; i++)
+            memset(out + i * stride, value, 8);
+        break;
+    }
+    case 2: _jpeg_IDCT8x8_fixed_NxN<2>(coeffs, qtab, out, stride); break;
+    case 4: _jpeg_IDCT8x8_fixed_NxN<4>(coeffs, qtab, out, stride); break;
+    default: _jpeg_IDCT8x8_fixed_NxN<8>(coeffs, qtab, out, stride); break;
+    }
+}
 
-            /* paste the RGB values to the image plane */
+/*
+floating point AAN IDCT. As with the fixed-point version, the AAN scale factors
+(and the final division by 8) are folded into the quantization table. The same
+butterflies are run on scalars or, when available, on SSE2/AVX vectors holding
+4 or 8 columns (or rows) of the block.
+*/
+inline REAL _jpeg_vadd(REAL a, REAL b) { return a + b; }
+inline REAL _jpeg_vsub(REAL a, REAL b) { return a - b; }
+inline REAL _jpeg_vmul(REAL a, REAL b) { return a * b; }
+#if defined(_JPEG_USE_SSE2)
+inline __m128 _jpeg_vadd(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+inline __m128 _jpeg_vsub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+inline __m128 _jpeg_vmul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+#endif
+#if defined(_JPEG_USE_AVX)
+inline __m256 _jpeg_vadd(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+inline __m256 _jpeg_vsub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+inline __m256 _jpeg_vmul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+#endif
 
-            int xoffset = i * MCU_width, yoffset = j * MCU_height;
-            MCU_plane[0].paste_to(image_plane[0], xoffset, yoffset);
-            MCU_plane[1].paste_to(image_plane[1], xoffset, yoffset);
-            MCU_plane[2].paste_to(image_plane[2], xoffset, yoffset);
+/*
+1D AAN IDCT on 8 values (or vectors) that are "stride" elements apart, c[] = { 1.414, 1.847, 1.082, 2.613 }.
+Only the first N (2, 4 or 8) of them can be nonzero; the reduced butterflies give the same
+results as the full ones fed with zeros.
+*/
+template <int N, typename T>
+inline void _jpeg_IDCT8_float(T* v, int stride, const T* c) {
+    T tmp0, tmp1, tmp2, tmp3, tmp7, tmp10, tmp11, tmp12, z5;
+
+    /* even part */
+    if (N > 4) {
+        tmp10 = _jpeg_vadd(v[0 * stride], v[4 * stride]);
+        tmp11 = _jpeg_vsub(v[0 * stride], v[4 * stride]);
+        T tmp13 = _jpeg_vadd(v[2 * stride], v[6 * stride]);
+        tmp12 = _jpeg_vsub(_jpeg_vmul(_jpeg_vsub(v[2 * stride], v[6 * stride]), c[0]), tmp13);
+        tmp0 = _jpeg_vadd(tmp10, tmp13);
+        tmp3 = _jpeg_vsub(tmp10, tmp13);
+        tmp1 = _jpeg_vadd(tmp11, tmp12);
+        tmp2 = _jpeg_vsub(tmp11, tmp12);
+    }
+    else if (N > 2) { /* v4 = v6 = 0 */
+        tmp12 = _jpeg_vsub(_jpeg_vmul(v[2 * stride], c[0]), v[2 * stride]);
+        tmp0 = _jpeg_vadd(v[0 * stride], v[2 * stride]);
+        tmp3 = _jpeg_vsub(v[0 * stride], v[2 * stride]);
+        tmp1 = _jpeg_vadd(v[0 * stride], tmp12);
+        tmp2 = _jpeg_vsub(v[0 * stride], tmp12);
+    }
+    else { /* v2 = v4 = v6 = 0 */
+        tmp0 = tmp1 = tmp2 = tmp3 = v[0 * stride];
+    }
 
-        }
+    /* odd part */
+    if (N > 4) {
+        T z13 = _jpeg_vadd(v[5 * stride], v[3 * stride]);
+        T z10 = _jpeg_vsub(v[5 * stride], v[3 * stride]);
+        T z11 = _jpeg_vadd(v[1 * stride], v[7 * stride]);
+        T z12 = _jpeg_vsub(v[1 * stride], v[7 * stride]);
+        tmp7 = _jpeg_vadd(z11, z13);
+        tmp11 = _jpeg_vmul(_jpeg_vsub(z11, z13), c[0]);
+        z5 = _jpeg_vmul(_jpeg_vadd(z10, z12), c[1]);
+        tmp10 = _jpeg_vsub(_jpeg_vmul(z12, c[2]), z5);
+        tmp12 = _jpeg_vsub(z5, _jpeg_vmul(z10, c[3]));
     }
+    else if (N > 2) { /* v5 = v7 = 0, so z13 = v3, z10 = -v3, z11 = z12 = v1 */
+        T d = _jpeg_vsub(v[1 * stride], v[3 * stride]);
+        tmp7 = _jpeg_vadd(v[1 * stride], v[3 * stride]);
+        tmp11 = _jpeg_vmul(d, c[0]);
+        z5 = _jpeg_vmul(d, c[1]);
+        tmp10 = _jpeg_vsub(_jpeg_vmul(v[1 * stride], c[2]), z5);
+        tmp12 = _jpeg_vadd(z5, _jpeg_vmul(v[3 * stride], c[3]));
+    }
+    else { /* only v1 */
+        tmp7 = v[1 * stride];
+        tmp11 = _jpeg_vmul(v[1 * stride], c[0]);
+        z5 = _jpeg_vmul(v[1 * stride], c[1]);
+        tmp10 = _jpeg_vsub(_jpeg_vmul(v[1 * stride], c[2]), z5);
+        tmp12 = z5;
+    }
+    T tmp6 = _jpeg_vsub(tmp12, tmp7);
+    T tmp5 = _jpeg_vsub(tmp11, tmp6);
+    T tmp4 = _jpeg_vadd(tmp10, tmp5);
+
+    v[0 * stride] = _jpeg_vadd(tmp0, tmp7);
+    v[7 * stride] = _jpeg_vsub(tmp0, tmp7);
+    v[1 * stride] = _jpeg_vadd(tmp1, tmp6);
+    v[6 * stride] = _jpeg_vsub(tmp1, tmp6);
+    v[2 * stride] = _jpeg_vadd(tmp2, tmp5);
+    v[5 * stride] = _jpeg_vsub(tmp2, tmp5);
+    v[4 * stride] = _jpeg_vadd(tmp3, tmp4);
+    v[3 * stride] = _jpeg_vsub(tmp3, tmp4);
+}
 
-    /* allocate image and dump data */
+const REAL _IDCT_AAN_C[4] = {
+    REAL(1.414213562373095), REAL(1.847759065022573), REAL(1.082392200292393), REAL(2.613125929752753)
+};
 
-    if (!alloc_image(jfile->image_width, jfile->image_height, image_ptr)) {
-        _jpeg_dump_message(jfile, "cannot allocate image storage space, maybe the image is too large.");
-        return false;
+#if defined(_JPEG_USE_AVX)
+/* transpose 8x8 floats held in 8 row vectors */
+inline void _jpeg_transpose8x8(__m256* r) {
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20); r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20); r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20); r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20); r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+#elif defined(_JPEG_USE_SSE2)
+/* transpose 8x8 floats held in the left (cols 0~3) and right (cols 4~7) halves of 8 rows */
+inline void _jpeg_transpose8x8(__m128* lo, __m128* hi) {
+    _MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+    _MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+    _MM_TRANSPOSE4_PS(lo[4], lo[5], lo[6], lo[7]);
+    _MM_TRANSPOSE4_PS(hi[4], hi[5], hi[6], hi[7]);
+    for (int i = 0; i < 4; i++) { /* swap the off-diagonal 4x4 blocks */
+        __m128 t = hi[i]; hi[i] = lo[i + 4]; lo[i + 4] = t;
     }
+}
+#endif
+
+#if defined(_JPEG_USE_SSE2)
+/* round 8 samples (held in two vectors) to integers, level shift them and store them as bytes */
+inline void _jpeg_store_samples(__m128 lo, __m128 hi, BYTE* out) {
+    __m128i v = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+    v = _mm_adds_epi16(v, _mm_set1_epi16(128));
+    _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(v, v));
+}
+#endif
+
+/* floating point IDCT of a block whose nonzero coefficients are all in the top-left NxN corner */
+template <int N>
+void _jpeg_IDCT8x8_float_NxN(INT_8x8* coeffs, const REAL* qtab, BYTE* out, int stride) {
+#if defined(_JPEG_USE_AVX)
+    /* each vector is a row, the column pass processes 8 columns at once */
+    const __m256 c[4] = { _mm256_set1_ps(_IDCT_AAN_C[0]), _mm256_set1_ps(_IDCT_AAN_C[1]),
+                          _mm256_set1_ps(_IDCT_AAN_C[2]), _mm256_set1_ps(_IDCT_AAN_C[3]) };
+    __m256 r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = (i < N) ? _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)coeffs->data[i])), _mm256_loadu_ps(qtab + i * 8))
+                       : _mm256_setzero_ps();
+    _jpeg_IDCT8_float<N>(r, 1, c);
+    _jpeg_transpose8x8(r);
+    _jpeg_IDCT8_float<N>(r, 1, c);
+    _jpeg_transpose8x8(r);
+    for (int i = 0; i < 8; i++)
+        _jpeg_store_samples(_mm256_castps256_ps128(r[i]), _mm256_extractf128_ps(r[i], 1), out + i * stride);
+#elif defined(_JPEG_USE_SSE2)
+    /* each row is split into two vectors, the column pass processes 4 columns at once */
+    const __m128 c[4] = { _mm_set1_ps(_IDCT_AAN_C[0]), _mm_set1_ps(_IDCT_AAN_C[1]),
+                          _mm_set1_ps(_IDCT_AAN_C[2]), _mm_set1_ps(_IDCT_AAN_C[3]) };
+    __m128 lo[8], hi[8];
+    for (int i = 0; i < 8; i++) {
+        lo[i] = (i < N) ? _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)coeffs->data[i])), _mm_loadu_ps(qtab + i * 8))
+                        : _mm_setzero_ps();
+        hi[i] = (i < N && N > 4) ? _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(coeffs->data[i] + 4))), _mm_loadu_ps(qtab + i * 8 + 4))
+                                 : _mm_setzero_ps();
+    }
+    _jpeg_IDCT8_float<N>(lo, 1, c);
+    if (N > 4) /* otherwise the right half is zero */
+        _jpeg_IDCT8_float<N>(hi, 1, c);
+    _jpeg_transpose8x8(lo, hi);
+    _jpeg_IDCT8_float<N>(lo, 1, c);
+    _jpeg_IDCT8_float<N>(hi, 1, c);
+    _jpeg_transpose8x8(lo, hi);
+    for (int i = 0; i < 8; i++)
+        _jpeg_store_samples(lo[i], hi[i], out + i * stride);
+#else
+    REAL block[64]; /* only the entries read by the IDCT below are ever filled */
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j < N; j++)
+            block[i * 8 + j] = REAL(coeffs->data[i][j]) * qtab[i * 8 + j];
+    /* IDCT for each column, the last 8-N columns are zero and stay zero */
+    for (int i = 0; i < N; i++)
+        _jpeg_IDCT8_float<N>(block + i, 8, _IDCT_AAN_C);
+    /* IDCT for each row, then level shift */
+    for (int i = 0; i < 8; i++) {
+        _jpeg_IDCT8_float<N>(block + i * 8, 1, _IDCT_AAN_C);
+        for (int j = 0; j < 8; j++)
+            out[i * stride + j] = _jpeg_byte_clamp(int(floor(block[i * 8 + j] + REAL(128.5))));
+    }
+#endif
+}
 
-    int plane_bytes = sizeof(BYTE) * jfile->image_width * jfile->image_height;
-    memcpy((*image_ptr)->r, image_plane[0].data(), plane_bytes);
-    memcpy((*image_ptr)->g, image_plane[1].data(), plane_bytes);
-    memcpy((*image_ptr)->b, image_plane[2].data(), plane_bytes);
-
-    return true;
+/*
+dequantize and IDCT a block with the floating point AAN IDCT, "qtab" is the scaled
+quantization table and "last" the zigzag index of the last nonzero coefficient.
+The level shifted samples are written as bytes to "out", rows are "stride" bytes apart.
+*/
+void _jpeg_IDCT8x8_float(INT_8x8* coeffs, int last, const REAL* qtab, BYTE* out, int stride) {
+    switch (_jpeg_zz_idct_size[last]) {
+    case 1: { /* DC only, the block is flat */
+        BYTE value = _jpeg_byte_clamp(int(floor(REAL(coeffs->data[0][0]) * qtab[0] + REAL(128.5))));
+        for (int i = 0; i < 8; i++)
+            memset(out + i * stride, value, 8);
+        break;
+    }
+    case 2: _jpeg_IDCT8x8_float_NxN<2>(coeffs, qtab, out, stride); break;
+    case 4: _jpeg_IDCT8x8_float_NxN<4>(coeffs, qtab, out, stride); break;
+    default: _jpeg_IDCT8x8_float_NxN<8>(coeffs, qtab, out, stride); break;
+    }
 }
 
-/* the JPEG main reading function */
-bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
+/*
+reduced size IDCT for scaled decoding: each output sample is the mean of the samples
+of the full 8x8 IDCT it covers, so the block is downscaled by 8/N (N = 8, 4, 2 or 1)
+without aliasing. Averaging k = 8/N consecutive samples of the 8-point IDCT gives
+  out(x) = sum_u C(u)/2 * F(u) * B_N(x, u)
+  B_N(x, u) = 1/k * sum_j cos((2(kx+j)+1)u*PI/16), j = 0 ~ k-1
+For u < N, B_N is the N-point IDCT cos((2x+1)u*PI/2N) weighted for each frequency
+(by cos(u*PI/16) when N = 4), and the frequencies above N are folded back instead of
+dropped. B_8 is the plain 8-point IDCT and B_1 keeps the DC only. The normalization
+C(u)C(v)/4 is folded into the quantization table, so that a DC-only block gives the
+same value at every size.
+*/
+const REAL _IDCT_BOX8[8][8] = { /* [x][u] */
+    { REAL(1), REAL(0.980785280403230), REAL(0.923879532511287), REAL(0.831469612302545),
+      REAL(0.707106781186548), REAL(0.555570233019602), REAL(0.382683432365090), REAL(0.195090322016128) },
+    { REAL(1), REAL(0.831469612302545), REAL(0.382683432365090), REAL(-0.195090322016128),
+      REAL(-0.707106781186547), REAL(-0.980785280403230), REAL(-0.923879532511287), REAL(-0.555570233019602) },
+    { REAL(1), REAL(0.555570233019602), REAL(-0.382683432365090), REAL(-0.980785280403230),
+      REAL(-0.707106781186548), REAL(0.195090322016128), REAL(0.923879532511287), REAL(0.831469612302545) },
+    { REAL(1), REAL(0.195090322016128), REAL(-0.923879532511287), REAL(-0.555570233019602),
+      REAL(0.707106781186547), REAL(0.831469612302545), REAL(-0.382683432365090), REAL(-0.980785280403231) },
+    { REAL(1), REAL(-0.195090322016128), REAL(-0.923879532511287), REAL(0.555570233019602),
+      REAL(0.707106781186548), REAL(-0.831469612302545), REAL(-0.382683432365091), REAL(0.980785280403230) },
+    { REAL(1), REAL(-0.555570233019602), REAL(-0.382683432365090), REAL(0.980785280403230),
+      REAL(-0.707106781186547), REAL(-0.195090322016128), REAL(0.923879532511287), REAL(-0.831469612302545) },
+    { REAL(1), REAL(-0.831469612302545), REAL(0.382683432365090), REAL(0.195090322016129),
+      REAL(-0.707106781186547), REAL(0.980785280403231), REAL(-0.923879532511286), REAL(0.555570233019602) },
+    { REAL(1), REAL(-0.980785280403230), REAL(0.923879532511287), REAL(-0.831469612302545),
+      REAL(0.707106781186547), REAL(-0.555570233019602), REAL(0.382683432365090), REAL(-0.195090322016129) }
+};
+const REAL _IDCT_BOX4[4][8] = { /* [x][u] */
+    { REAL(1), REAL(0.906127446352888), REAL(0.653281482438188), REAL(0.318189645143209),
+      REAL(0), REAL(-0.212607523691814), REAL(-0.270598050073099), REAL(-0.180239955501737) },
+    { REAL(1), REAL(0.375330277517865), REAL(-0.653281482438188), REAL(-0.768177756711416),
+      REAL(0), REAL(0.513279967159337), REAL(0.270598050073098), REAL(-0.074657834050343) },
+    { REAL(1), REAL(-0.375330277517865), REAL(-0.653281482438189), REAL(0.768177756711416),
+      REAL(0), REAL(-0.513279967159337), REAL(0.270598050073098), REAL(0.074657834050343) },
+    { REAL(1), REAL(-0.906127446352888), REAL(0.653281482438188), REAL(-0.318189645143208),
+      REAL(0), REAL(0.212607523691815), REAL(-0.270598050073098), REAL(0.180239955501736) }
+};
+const REAL _IDCT_BOX2[2][8] = { /* [x][u] */
+    { REAL(1), REAL(0.640728861935377), REAL(0), REAL(-0.224994055784104),
+      REAL(0), REAL(0.150336221733761), REAL(0), REAL(-0.127448894776040) },
+    { REAL(1), REAL(-0.640728861935376), REAL(0), REAL(0.224994055784104),
+      REAL(0), REAL(-0.150336221733761), REAL(0), REAL(0.127448894776040) }
+};
+/* B_N for an output size of N samples, NULL for N = 1 (DC only) */
+const REAL* _jpeg_IDCT_box_table(int N) {
+    if (N == 8) return &(_IDCT_BOX8[0][0]);
+    if (N == 4) return &(_IDCT_BOX4[0][0]);
+    if (N == 2) return &(_IDCT_BOX2[0][0]);
+    return NULL;
+}
 
-    /* initialize header information */
-    jfile->image_data = NULL;
-    jfile->is_valid = false;
-    jfile->zero_start = false; /* default */
-    jfile->image_width = 0;
-    jfile->image_height = 0;
-    memset(jfile->message, 0, _JPEG_MSG_LEN);
-    for (int i = 0; i < 4; i++) {
-        jfile->channels[i].is_used = false;
+/*
+dequantize and IDCT a block into a "width" x "height" block (8, 4, 2 or 1 in each direction)
+of level shifted samples, "last" is the zigzag index of the last nonzero coefficient
+*/
+void _jpeg_IDCT8x8_scaled(INT_8x8* coeffs, int last, const REAL* qtab, int width, int height, BYTE* out, int stride) {
+    if ((width == 1 && height == 1) || last == 0) { /* only the DC coefficient is needed */
+        BYTE value = _jpeg_byte_clamp(int(floor(REAL(coeffs->data[0][0]) * qtab[0] + REAL(128.5))));
+        for (int i = 0; i < height; i++)
+            memset(out + i * stride, value, width);
+        return;
     }
-    jfile->restart_interval = 0;
-    for (int i = 0; i < 4; i++) {
-        jfile->actabs[i].is_used = false;
-        jfile->dctabs[i].is_used = false;
-        for (int j = 0; j < 17; j++) {
-            jfile->actabs[i].offsets[j] = 0;
-            jfile->dctabs[i].offsets[j] = 0;
+    /* the coefficients outside the top-left n x n ones are zero */
+    int n = _jpeg_zz_idct_size[last];
+    const REAL* hbox = _jpeg_IDCT_box_table(width);
+    const REAL* vbox = _jpeg_IDCT_box_table(height);
+    REAL F[8][8], tmp[8][8];
+    for (int u = 0; u < n; u++)
+        for (int v = 0; v < n; v++)
+            F[u][v] = REAL(coeffs->data[u][v]) * qtab[u * 8 + v];
+    /* IDCT for each column (u is the vertical frequency), then for each row */
+    for (int y = 0; y < height; y++) {
+        for (int v = 0; v < n; v++) {
+            REAL sum = F[0][v];
+            for (int u = 1; u < n && vbox != NULL; u++)
+                sum += vbox[y * 8 + u] * F[u][v];
+            tmp[y][v] = sum;
         }
-        for (int j = 0; j < 162; j++) {
-            jfile->actabs[i].symbols[j] = 0;
-            jfile->dctabs[i].symbols[j] = 0;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            REAL sum = tmp[y][0];
+            for (int v = 1; v < n && hbox != NULL; v++)
+                sum += hbox[x * 8 + v] * tmp[y][v];
+            out[y * stride + x] = _jpeg_byte_clamp(int(floor(sum + REAL(128.5))));
         }
     }
+}
 
-    BYTE marker[2];
-    /* JPEG markers are two bytes long */
-    _jpeg_read_fp(fp, 2, marker); /* from fp read 2 bytes to marker */
+/* quantization tables prepared once per image for the selected IDCT */
+struct JPEG_IDCT_TABLE {
+    REAL real_qtab[64];   /* float IDCT: quantization table with the AAN scale factors folded in */
+    int fixed_qtab[64];   /* fixed-point IDCT: quantization table with the AAN scale factors folded in */
+    REAL scaled_qtab[64]; /* reduced size IDCT: quantization table with C(u)C(v)/4 folded in */
+};
 
-    if (marker[0] != 0xFF || marker[1] != SOI) {
-        _jpeg_dump_message(jfile, "invalid JPEG image marker.");
+void _jpeg_prepare_IDCT_table(INT_8x8* qtab, JPEG_IDCT_TABLE* table) {
+    /* AAN scale factors: s[0] = 1, s[k] = sqrt(2) * cos(k*PI/16) */
+    double aan_scales[8];
+    for (int k = 0; k < 8; k++)
+        aan_scales[k] = (k == 0) ? 1.0 : 1.414213562373095 * cos(k * 3.141592653589793 / 16.0);
+    for (int u = 0; u < 8; u++) {
+        for (int v = 0; v < 8; v++) {
+            int q = qtab->data[u][v];
+            table->real_qtab[u * 8 + v] = REAL(q * aan_scales[u] * aan_scales[v] / 8.0);
+            table->fixed_qtab[u * 8 + v] =
+                int(floor(q * aan_scales[u] * aan_scales[v] * (1 << _JPEG_IDCT_QTAB_BITS) + 0.5));
+            table->scaled_qtab[u * 8 + v] =
+                REAL(q * (u == 0 ? 0.707106781186548 : 1.0) * (v == 0 ? 0.707106781186548 : 1.0) / 4.0);
+        }
+    }
+}
+
+/* size of an MCU in pixels, when the blocks are decoded as "block_size" x "block_size" pixels */
+void _jpeg_MCU_size(int subsampling_type, int block_size, int* MCU_width, int* MCU_height) {
+    (*MCU_width) = (subsampling_type == 2 || subsampling_type == 4) ? 2 * block_size : block_size;
+    (*MCU_height) = (subsampling_type == 3 || subsampling_type == 4) ? 2 * block_size : block_size;
+}
+
+/*
+size of the chroma block of an MCU in pixels. Scaled decoding transforms the subsampled
+chroma blocks to the size of the MCU (e.g. 8x8 at 1/2 with 4:2:0, as libjpeg does), so
+that the chroma is at the output resolution and never upsampled. At full size they are
+"block_size" x "block_size" and upsampled.
+*/
+void _jpeg_chroma_size(int subsampling_type, int block_size, int* chroma_width, int* chroma_height) {
+    if (block_size == 8) {
+        (*chroma_width) = (*chroma_height) = block_size;
+        return;
+    }
+    _jpeg_MCU_size(subsampling_type, block_size, chroma_width, chroma_height);
+}
+
+/* dequantize and IDCT a block into "width" x "height" samples (8x8: full size, 4, 2 or 1 in each direction: scaled) */
+inline void _jpeg_IDCT_block(INT_8x8* coeffs, int last, JPEG_IDCT_TABLE* table, int idct_method, int width, int height,
+    BYTE* out, int stride) {
+    if (width != 8 || height != 8)
+        _jpeg_IDCT8x8_scaled(coeffs, last, table->scaled_qtab, width, height, out, stride);
+    else if (idct_method == JPEG_IDCT_FIXED)
+        _jpeg_IDCT8x8_fixed(coeffs, last, table->fixed_qtab, out, stride);
+    else
+        _jpeg_IDCT8x8_float(coeffs, last, table->real_qtab, out, stride);
+}
+
+/*
+dequantize and IDCT the coefficients of "count" consecutive MCUs of a row. The samples
+are written as bytes to the component rows "comp_row" (Y, Cb, Cr), the first MCU at
+their start. The rows of component c are comp_stride[c] bytes apart. With "luma_only"
+(and for grayscale images) only the Y row is written.
+*/
+bool _jpeg_IDCT_MCUs(JPEG_FILE* jfile, JPEG_MCU_COEFF* coeffs, int count, int subsampling_type, int block_size,
+    JPEG_IDCT_TABLE* tables, int idct_method, bool luma_only, BYTE** comp_row, int* comp_stride) {
+
+    JPEG_IDCT_TABLE* Ytab = &(tables[jfile->channels[0].qtab_id]);
+    JPEG_IDCT_TABLE* Cbtab = &(tables[jfile->channels[1].qtab_id]);
+    JPEG_IDCT_TABLE* Crtab = &(tables[jfile->channels[2].qtab_id]);
+    int MCU_width, MCU_height, chroma_width, chroma_height;
+    _jpeg_MCU_size(subsampling_type, block_size, &MCU_width, &MCU_height);
+    _jpeg_chroma_size(subsampling_type, block_size, &chroma_width, &chroma_height);
+    /* position of the luminance blocks Y1, Y2 and Y3 relative to Y0 */
+    int Ystride = comp_stride[0];
+    int Y1_offset = (subsampling_type == 3) ? block_size * Ystride : block_size;
+    int Y2_offset = block_size * Ystride, Y3_offset = block_size * Ystride + block_size;
+    for (int i = 0; i < count; i++) { /* for each MCU in raster scan order */
+        BYTE* Y = comp_row[0] + i * MCU_width;
+        BYTE* Cb = comp_row[1] + i * chroma_width;
+        BYTE* Cr = comp_row[2] + i * chroma_width;
+        _jpeg_IDCT_block(&(coeffs[i].Y0), coeffs[i].Y0_last, Ytab, idct_method, block_size, block_size, Y, Ystride);
+        if (subsampling_type >= 2)
+            _jpeg_IDCT_block(&(coeffs[i].Y1), coeffs[i].Y1_last, Ytab, idct_method, block_size, block_size, Y + Y1_offset, Ystride);
+        if (subsampling_type >= 4) {
+            _jpeg_IDCT_block(&(coeffs[i].Y2), coeffs[i].Y2_last, Ytab, idct_method, block_size, block_size, Y + Y2_offset, Ystride);
+            _jpeg_IDCT_block(&(coeffs[i].Y3), coeffs[i].Y3_last, Ytab, idct_method, block_size, block_size, Y + Y3_offset, Ystride);
+        }
+        if (luma_only)
+            continue;
+        _jpeg_IDCT_block(&(coeffs[i].Cb), coeffs[i].Cb_last, Cbtab, idct_method, chroma_width, chroma_height, Cb, comp_stride[1]);
+        _jpeg_IDCT_block(&(coeffs[i].Cr), coeffs[i].Cr_last, Crtab, idct_method, chroma_width, chroma_height, Cr, comp_stride[2]);
+    }
+    return true;
+}
+
+/*
+fixed-point YCbCr to RGB conversion (JFIF):
+  R = Y + 1.402 (Cr-128)
+  G = Y - 0.344136 (Cb-128) - 0.714136 (Cr-128)
+  B = Y + 1.772 (Cb-128)
+The factors have 14 fraction bits. The chroma terms are computed as
+((C-128) * 2^7 * factor) >> 16, which keeps _JPEG_CC_FRAC_BITS fraction bits and
+is exactly what _mm_mulhi_epi16 does, so the scalar and SIMD code give the same
+results. All intermediate values fit in 16 bits.
+*/
+#define _JPEG_CC_FRAC_BITS 5
+
+const int _CC_FIX_1_402 = 22970;    /* round(1.402 * 2^14) */
+const int _CC_FIX_0_344136 = 5638;  /* round(0.344136 * 2^14) */
+const int _CC_FIX_0_714136 = 11700; /* round(0.714136 * 2^14) */
+const int _CC_FIX_1_772 = 29032;    /* round(1.772 * 2^14) */
+
+#if defined(_JPEG_USE_SSE2)
+/* chroma terms of 8 chroma samples (16-bit, centered on 128), computed once and shared by the pixels using them */
+inline void _jpeg_chroma_terms(__m128i cb, __m128i cr, __m128i* tR, __m128i* tG, __m128i* tB) {
+    cb = _mm_slli_epi16(_mm_sub_epi16(cb, _mm_set1_epi16(128)), 7);
+    cr = _mm_slli_epi16(_mm_sub_epi16(cr, _mm_set1_epi16(128)), 7);
+    (*tR) = _mm_mulhi_epi16(cr, _mm_set1_epi16(_CC_FIX_1_402));
+    (*tG) = _mm_add_epi16(_mm_mulhi_epi16(cb, _mm_set1_epi16(_CC_FIX_0_344136)), _mm_mulhi_epi16(cr, _mm_set1_epi16(_CC_FIX_0_714136)));
+    (*tB) = _mm_mulhi_epi16(cb, _mm_set1_epi16(_CC_FIX_1_772));
+}
+
+/* add the chroma terms of 16 pixels (two vectors of 8) to 16 luminance samples and store R, G and B */
+inline void _jpeg_store_RGB(const BYTE* Y, const __m128i* tR, const __m128i* tG, const __m128i* tB, BYTE* R, BYTE* G, BYTE* B) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(1 << (_JPEG_CC_FRAC_BITS - 1));
+    __m128i y = _mm_loadu_si128((const __m128i*)Y);
+    __m128i r[2], g[2], b[2];
+    for (int h = 0; h < 2; h++) {
+        __m128i yh = (h == 0) ? _mm_unpacklo_epi8(y, zero) : _mm_unpackhi_epi8(y, zero);
+        yh = _mm_add_epi16(_mm_slli_epi16(yh, _JPEG_CC_FRAC_BITS), rounding);
+        r[h] = _mm_srai_epi16(_mm_add_epi16(yh, tR[h]), _JPEG_CC_FRAC_BITS);
+        g[h] = _mm_srai_epi16(_mm_sub_epi16(yh, tG[h]), _JPEG_CC_FRAC_BITS);
+        b[h] = _mm_srai_epi16(_mm_add_epi16(yh, tB[h]), _JPEG_CC_FRAC_BITS);
+    }
+    /* saturate to 0~255 */
+    _mm_storeu_si128((__m128i*)R, _mm_packus_epi16(r[0], r[1]));
+    _mm_storeu_si128((__m128i*)G, _mm_packus_epi16(g[0], g[1]));
+    _mm_storeu_si128((__m128i*)B, _mm_packus_epi16(b[0], b[1]));
+}
+#endif
+
+/*
+merged chroma upsampling and color conversion of "vfactor" (1 or 2) lines of "width" pixels
+sharing the same chroma line, the chroma samples are horizontally subsampled by "hfactor"
+(1 or 2). The chroma terms are computed once for each chroma sample and added to the
+hfactor x vfactor luminance samples covered by it (h1v1, h2v1, h1v2 and h2v2 kernels).
+"Y[1]", "R[1]", "G[1]" and "B[1]" are only used when vfactor = 2.
+*/
+template<int hfactor, int vfactor>
+void _jpeg_YCbCr_to_RGB_merged(const BYTE** Y, const BYTE* Cb, const BYTE* Cr, int width, BYTE** R, BYTE** G, BYTE** B) {
+    int x = 0;
+#if defined(_JPEG_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) { /* 16 pixels at a time */
+        __m128i tR[2], tG[2], tB[2];
+        if (hfactor == 1) {
+            __m128i cb = _mm_loadu_si128((const __m128i*)(Cb + x));
+            __m128i cr = _mm_loadu_si128((const __m128i*)(Cr + x));
+            _jpeg_chroma_terms(_mm_unpacklo_epi8(cb, zero), _mm_unpacklo_epi8(cr, zero), &tR[0], &tG[0], &tB[0]);
+            _jpeg_chroma_terms(_mm_unpackhi_epi8(cb, zero), _mm_unpackhi_epi8(cr, zero), &tR[1], &tG[1], &tB[1]);
+        }
+        else { /* 8 chroma samples, each term is duplicated for 2 pixels */
+            __m128i cb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(Cb + x / 2)), zero);
+            __m128i cr = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(Cr + x / 2)), zero);
+            __m128i r, g, b;
+            _jpeg_chroma_terms(cb, cr, &r, &g, &b);
+            tR[0] = _mm_unpacklo_epi16(r, r); tR[1] = _mm_unpackhi_epi16(r, r);
+            tG[0] = _mm_unpacklo_epi16(g, g); tG[1] = _mm_unpackhi_epi16(g, g);
+            tB[0] = _mm_unpacklo_epi16(b, b); tB[1] = _mm_unpackhi_epi16(b, b);
+        }
+        for (int v = 0; v < vfactor; v++)
+            _jpeg_store_RGB(Y[v] + x, tR, tG, tB, R[v] + x, G[v] + x, B[v] + x);
+    }
+#endif
+    for (; x < width; x += hfactor) { /* one chroma sample at a time */
+        int cb = (int(Cb[x / hfactor]) - 128) * 128;
+        int cr = (int(Cr[x / hfactor]) - 128) * 128;
+        int tR = (cr * _CC_FIX_1_402) >> 16;
+        int tG = ((cb * _CC_FIX_0_344136) >> 16) + ((cr * _CC_FIX_0_714136) >> 16);
+        int tB = (cb * _CC_FIX_1_772) >> 16;
+        for (int v = 0; v < vfactor; v++) {
+            for (int i = x; i < x + hfactor && i < width; i++) {
+                int y = (int(Y[v][i]) << _JPEG_CC_FRAC_BITS) + (1 << (_JPEG_CC_FRAC_BITS - 1));
+                R[v][i] = _jpeg_byte_clamp((y + tR) >> _JPEG_CC_FRAC_BITS);
+                G[v][i] = _jpeg_byte_clamp((y - tG) >> _JPEG_CC_FRAC_BITS);
+                B[v][i] = _jpeg_byte_clamp((y + tB) >> _JPEG_CC_FRAC_BITS);
+            }
+        }
+    }
+}
+
+/* convert a line of "width" pixels, the chroma samples are horizontally subsampled by "hfactor" (1 or 2) */
+void _jpeg_YCbCr_to_RGB_row(const BYTE* Y, const BYTE* Cb, const BYTE* Cr, int hfactor, int width,
+    BYTE* R, BYTE* G, BYTE* B) {
+    if (hfactor == 2)
+        _jpeg_YCbCr_to_RGB_merged<2, 1>(&Y, Cb, Cr, width, &R, &G, &B);
+    else
+        _jpeg_YCbCr_to_RGB_merged<1, 1>(&Y, Cb, Cr, width, &R, &G, &B);
+}
+
+/* convert two lines of "width" pixels sharing the same chroma line (vertical subsampling) */
+void _jpeg_YCbCr_to_RGB_rows(const BYTE** Y, const BYTE* Cb, const BYTE* Cr, int hfactor, int width,
+    BYTE** R, BYTE** G, BYTE** B) {
+    if (hfactor == 2)
+        _jpeg_YCbCr_to_RGB_merged<2, 2>(Y, Cb, Cr, width, R, G, B);
+    else
+        _jpeg_YCbCr_to_RGB_merged<1, 2>(Y, Cb, Cr, width, R, G, B);
+}
+
+/* number of bytes of a pixel in the given format (of a plane for JPEG_PIXEL_PLANAR_RGB), 0 if the format is unknown */
+int _jpeg_pixel_size(int format) {
+    switch (format) {
+    case JPEG_PIXEL_PLANAR_RGB: return 1;
+    case JPEG_PIXEL_RGB: return 3;
+    case JPEG_PIXEL_BGR: return 3;
+    case JPEG_PIXEL_RGBA: return 4;
+    case JPEG_PIXEL_BGRA: return 4;
+    case JPEG_PIXEL_GRAY: return 1;
+    default: return 0;
+    }
+}
+
+/* interleave a line of "width" R, G and B samples into pixels of the given format (RGB, BGR, RGBA or BGRA) */
+void _jpeg_pack_pixels(const BYTE* R, const BYTE* G, const BYTE* B, int width, int format, BYTE* out) {
+    /* BGR(A) is RGB(A) with the first and the third channel swapped */
+    const BYTE* c0 = (format == JPEG_PIXEL_BGR || format == JPEG_PIXEL_BGRA) ? B : R;
+    const BYTE* c2 = (format == JPEG_PIXEL_BGR || format == JPEG_PIXEL_BGRA) ? R : B;
+    int x = 0;
+    if (format == JPEG_PIXEL_RGBA || format == JPEG_PIXEL_BGRA) {
+#if defined(_JPEG_USE_SSE2)
+        const __m128i alpha = _mm_set1_epi8(char(0xFF));
+        for (; x + 16 <= width; x += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i*)(c0 + x));
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(G + x));
+            __m128i v2 = _mm_loadu_si128((const __m128i*)(c2 + x));
+            __m128i lo01 = _mm_unpacklo_epi8(v0, v1), hi01 = _mm_unpackhi_epi8(v0, v1);
+            __m128i lo2a = _mm_unpacklo_epi8(v2, alpha), hi2a = _mm_unpackhi_epi8(v2, alpha);
+            __m128i* p = (__m128i*)(out + x * 4);
+            _mm_storeu_si128(p + 0, _mm_unpacklo_epi16(lo01, lo2a));
+            _mm_storeu_si128(p + 1, _mm_unpackhi_epi16(lo01, lo2a));
+            _mm_storeu_si128(p + 2, _mm_unpacklo_epi16(hi01, hi2a));
+            _mm_storeu_si128(p + 3, _mm_unpackhi_epi16(hi01, hi2a));
+        }
+#endif
+        for (; x < width; x++) {
+            out[x * 4 + 0] = c0[x];
+            out[x * 4 + 1] = G[x];
+            out[x * 4 + 2] = c2[x];
+            out[x * 4 + 3] = 0xFF;
+        }
+    }
+    else {
+        for (; x < width; x++) {
+            out[x * 3 + 0] = c0[x];
+            out[x * 3 + 1] = G[x];
+            out[x * 3 + 2] = c2[x];
+        }
+    }
+}
+
+/* write a line of "width" RGB pixels to "output", at "offset" bytes from the start of the buffer */
+void _jpeg_write_line(JPEG_PIXEL_BUFFER* output, int offset, const BYTE* R, const BYTE* G, const BYTE* B, int width) {
+    if (output->format == JPEG_PIXEL_PLANAR_RGB) {
+        memcpy(output->data[0] + offset, R, width);
+        memcpy(output->data[1] + offset, G, width);
+        memcpy(output->data[2] + offset, B, width);
+    }
+    else {
+        _jpeg_pack_pixels(R, G, B, width, output->format, output->data[0] + offset);
+    }
+}
+
+/* rectangle of the decoded image (after scaling), in pixels */
+struct JPEG_REGION {
+    int x, y;
+    int width, height;
+};
+
+/*
+convert the component rows of "count" consecutive MCUs to the pixel format of "output",
+the first one is the (mcu_x, mcu_y)-th MCU of the image. Only the pixels inside "roi"
+are written, the top-left pixel of "roi" goes to the first pixel of "output".
+"line_buffer" holds 6 lines of the MCU row, used when the output pixels are interleaved.
+With vertical subsampling, the two lines sharing a chroma line are converted together.
+*/
+bool _jpeg_decode_color(BYTE** comp_row, int* comp_stride, int count, int mcu_x, int mcu_y, int subsampling_type,
+    int block_size, JPEG_REGION* roi, JPEG_PIXEL_BUFFER* output, BYTE* line_buffer)
+{
+    int MCU_width, MCU_height, chroma_width, chroma_height;
+    _jpeg_MCU_size(subsampling_type, block_size, &MCU_width, &MCU_height);
+    _jpeg_chroma_size(subsampling_type, block_size, &chroma_width, &chroma_height);
+    int hfactor = MCU_width / chroma_width, vfactor = MCU_height / chroma_height;
+
+    /* clip the MCUs against the region (and so the edges of the image) */
+    int x0 = mcu_x * MCU_width, y0 = mcu_y * MCU_height;
+    int x1 = x0 + count * MCU_width, y1 = y0 + MCU_height;
+    int dx = 0, dy = 0; /* first pixel to convert, relative to the first MCU */
+    if (x0 < roi->x) dx = roi->x - x0;
+    if (y0 < roi->y) dy = roi->y - y0;
+    if (x1 > roi->x + roi->width) x1 = roi->x + roi->width;
+    if (y1 > roi->y + roi->height) y1 = roi->y + roi->height;
+    int width = x1 - (x0 + dx), height = y1 - (y0 + dy);
+    if (width <= 0 || height <= 0)
+        return true;
+    /* a region starting between two horizontally subsampled chroma samples is converted from the previous pixel */
+    int lead = dx % hfactor;
+
+    int format = output->format;
+    int pixel_size = _jpeg_pixel_size(format);
+    int line_size = comp_stride[0];
+    for (int y = dy; y < dy + height; y++) {
+        const BYTE* Y = comp_row[0] + y * comp_stride[0] + dx;
+        const BYTE* Cb = comp_row[1] + (y / vfactor) * comp_stride[1] + dx / hfactor;
+        const BYTE* Cr = comp_row[2] + (y / vfactor) * comp_stride[2] + dx / hfactor;
+        int offset = (y0 + y - roi->y) * output->stride + (x0 + dx - roi->x) * pixel_size;
+        if (format == JPEG_PIXEL_GRAY) { /* luminance is already there */
+            memcpy(output->data[0] + offset, Y, width);
+        }
+        else if (subsampling_type == 0) { /* grayscale image, R = G = B = Y */
+            _jpeg_write_line(output, offset, Y, Y, Y, width);
+        }
+        else {
+            int lines = (vfactor == 2 && y % 2 == 0 && y + 1 < dy + height) ? 2 : 1;
+            const BYTE* Ys[2] = { Y - lead, Y - lead + comp_stride[0] };
+            BYTE* Rs[2], * Gs[2], * Bs[2];
+            bool direct = (format == JPEG_PIXEL_PLANAR_RGB && lead == 0); /* convert straight into the planes */
+            for (int v = 0; v < lines; v++) {
+                Rs[v] = direct ? output->data[0] + offset + v * output->stride : line_buffer + (3 * v + 0) * line_size;
+                Gs[v] = direct ? output->data[1] + offset + v * output->stride : line_buffer + (3 * v + 1) * line_size;
+                Bs[v] = direct ? output->data[2] + offset + v * output->stride : line_buffer + (3 * v + 2) * line_size;
+            }
+            if (lines == 2)
+                _jpeg_YCbCr_to_RGB_rows(Ys, Cb, Cr, hfactor, width + lead, Rs, Gs, Bs);
+            else
+                _jpeg_YCbCr_to_RGB_row(Ys[0], Cb, Cr, hfactor, width + lead, Rs[0], Gs[0], Bs[0]);
+            for (int v = 0; v < lines && !direct; v++)
+                _jpeg_write_line(output, offset + v * output->stride, Rs[v] + lead, Gs[v] + lead, Bs[v] + lead, width);
+            y += lines - 1;
+        }
+    }
+    return true;
+}
+
+/*
+triangle filter ("fancy") chroma upsampling, as done by libjpeg: in each subsampled
+direction, an output sample is 3/4 of the nearest chroma sample and 1/4 of the next
+nearest one. "near" is the chroma line covering the output line and "far" the chroma
+line next to it, above the upper line or below the lower line ("lower") of the two
+covered by "near" (far = near without vertical subsampling). The chroma of pixels
+[x0, x1) is computed, the "width" chroma samples of the line are extended by
+replication at the edges. "colsum" holds (x1 - x0) + 32 temporary values, "out" receives
+x1 - x0 + 2 samples, the returned pointer is the chroma of pixel x0.
+*/
+BYTE* _jpeg_fancy_upsample(const BYTE* near, const BYTE* far, int hfactor, int vfactor, bool lower,
+    int x0, int x1, int width, short* colsum, BYTE* out) {
+
+    /* chroma samples i0 ~ i1 are used, and their neighbours when subsampled horizontally */
+    int i0 = x0 / hfactor - (hfactor - 1), i1 = (x1 - 1) / hfactor + (hfactor - 1);
+    int n = i1 - i0 + 1;
+    int k0 = (i0 < 0) ? -i0 : 0, k1 = (i1 >= width) ? width - 1 - i0 : n - 1; /* inside the line */
+
+    /* vertical pass: 3 * near + far, or the chroma sample itself */
+    int k = k0;
+#if defined(_JPEG_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; k + 8 <= k1 + 1; k += 8) {
+        __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(near + i0 + k)), zero);
+        if (vfactor == 2) {
+            __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(far + i0 + k)), zero);
+            s = _mm_add_epi16(_mm_add_epi16(s, _mm_add_epi16(s, s)), f);
+        }
+        _mm_storeu_si128((__m128i*)(colsum + k), s);
+    }
+#endif
+    for (; k <= k1; k++)
+        colsum[k] = (vfactor == 2) ? short(3 * near[i0 + k] + far[i0 + k]) : short(near[i0 + k]);
+    for (k = 0; k < k0; k++)
+        colsum[k] = colsum[k0];
+    for (k = k1 + 1; k < n; k++)
+        colsum[k] = colsum[k1];
+
+    /* horizontal pass */
+    if (hfactor == 1) { /* (3 * near + far + 1 or 2) / 4 */
+        int bias = lower ? 2 : 1;
+        int x = 0;
+#if defined(_JPEG_USE_SSE2)
+        const __m128i vbias = _mm_set1_epi16(short(bias));
+        for (; x + 16 <= n; x += 16) {
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(colsum + x)), vbias), 2);
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(colsum + x + 8)), vbias), 2);
+            _mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; x < n; x++)
+            out[x] = BYTE((colsum[x] + bias) >> 2);
+        return out;
+    }
+    /* two pixels per chroma sample: (3 * s[j] + s[j -/+ 1] + bias) >> shift, s[j] being */
+    /* the vertical sums (scaled by 4) or the chroma samples themselves */
+    const short* s = colsum + 1;
+    int m = n - 2; /* chroma samples covering the pixels */
+    int shift = (vfactor == 2) ? 4 : 2;
+    int bias_even = (vfactor == 2) ? 8 : 1, bias_odd = (vfactor == 2) ? 7 : 2;
+    int j = 0;
+#if defined(_JPEG_USE_SSE2)
+    const __m128i veven = _mm_set1_epi16(short(bias_even)), vodd = _mm_set1_epi16(short(bias_odd));
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    for (; j + 8 <= m; j += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + j));
+        __m128i l = _mm_loadu_si128((const __m128i*)(s + j - 1));
+        __m128i r = _mm_loadu_si128((const __m128i*)(s + j + 1));
+        __m128i c3 = _mm_add_epi16(c, _mm_add_epi16(c, c));
+        __m128i even = _mm_srl_epi16(_mm_add_epi16(_mm_add_epi16(c3, l), veven), vshift);
+        __m128i odd = _mm_srl_epi16(_mm_add_epi16(_mm_add_epi16(c3, r), vodd), vshift);
+        _mm_storeu_si128((__m128i*)(out + 2 * j), _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd)));
+    }
+#endif
+    for (; j < m; j++) {
+        out[2 * j] = BYTE((3 * s[j] + s[j - 1] + bias_even) >> shift);
+        out[2 * j + 1] = BYTE((3 * s[j] + s[j + 1] + bias_odd) >> shift);
+    }
+    return out + (x0 & 1);
+}
+
+/* natural (row-major) index of each zigzag index */
+const BYTE _jpeg_zz_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* copy the 64 coefficients at "in" (natural order) to a block, "last_nonzero" receives */
+/* the zigzag index of the last nonzero AC coefficient (0 if none) */
+void _jpeg_load_block(const short* in, INT_8x8* block, int* last_nonzero) {
+    int* out = &(block->data[0][0]);
+    for (int k = 0; k < 64; k++)
+        out[k] = int(in[k]);
+    int last = 63;
+    while (last > 0 && in[_jpeg_zz_natural[last]] == 0)
+        last--;
+    (*last_nonzero) = last;
+}
+
+/* read the "mcu"-th MCU from the coefficient planes, instead of decoding it from the bitstream */
+void _jpeg_load_MCU(const JPEG_COEFFICIENTS* coeffs, int mcu, int subsampling_type, bool luma_only, JPEG_MCU_COEFF* MCU) {
+    int nW = coeffs->MCUs_per_row;
+    int hfactor = coeffs->max_hsample, vfactor = coeffs->max_vsample;
+    int mcu_x = mcu % nW, mcu_y = mcu / nW;
+    int Y_stride = coeffs->planes[0].width_in_blocks * 64, C_stride = nW * 64;
+    INT_8x8* Y_blocks[4] = { &(MCU->Y0), &(MCU->Y1), &(MCU->Y2), &(MCU->Y3) };
+    int* Y_last[4] = { &(MCU->Y0_last), &(MCU->Y1_last), &(MCU->Y2_last), &(MCU->Y3_last) };
+    const short* Y = coeffs->planes[0].data + mcu_y * vfactor * Y_stride + mcu_x * hfactor * 64;
+    for (int b = 0; b < hfactor * vfactor; b++)
+        _jpeg_load_block(Y + (b / hfactor) * Y_stride + (b % hfactor) * 64, Y_blocks[b], Y_last[b]);
+    if (subsampling_type == 0 || luma_only)
+        return;
+    _jpeg_load_block(coeffs->planes[1].data + mcu_y * C_stride + mcu_x * 64, &(MCU->Cb), &(MCU->Cb_last));
+    _jpeg_load_block(coeffs->planes[2].data + mcu_y * C_stride + mcu_x * 64, &(MCU->Cr), &(MCU->Cr_last));
+}
+
+/*
+start decoding at the restart interval that begins with the "mcu"-th MCU (the whole
+bitstream without restart markers): intervals end at the next RST marker, and the DC
+predictors are reset at the start of every interval.
+*/
+void _jpeg_start_interval(JPEG_FILE* jfile, int mcu, JPEG_BIT_READER* bit_reader, int* prev_DC_coeffs) {
+    int interval_start = 0, interval_end = jfile->hstream_size;
+    if (jfile->restart_interval != 0) {
+        int interval = mcu / jfile->restart_interval;
+        if (interval > 0)
+            interval_start = jfile->rst_offsets[interval - 1] + 2;
+        if (interval < jfile->rst_offsets.size())
+            interval_end = jfile->rst_offsets[interval];
+    }
+    _jpeg_bit_reader_init(bit_reader, jfile->hstream + interval_start, interval_end - interval_start);
+    prev_DC_coeffs[0] = prev_DC_coeffs[1] = prev_DC_coeffs[2] = 0;
+}
+
+/*
+state of a thread decoding a part of the image. The Huffman bitstream is
+divided into restart intervals (separated by RST markers) that can be
+decoded independently, each thread takes a group of consecutive intervals.
+The MCUs are decoded, dequantized, transformed and converted to RGB one
+row at a time, so a thread only keeps a single row of MCUs in memory.
+MCUs outside the region of interest are only entropy decoded.
+The MCUs of progressive images are read from coefficient planes instead,
+each row is then an interval.
+With fancy upsampling, the chroma of a row also depends on the rows above
+and below: the thread keeps the previous row, and the MCUs around the
+intervals of the thread are decoded too (but not output).
+*/
+struct JPEG_MCU_WORKER {
+    JPEG_FILE* jfile;
+    int nW;                          /* number of MCUs in a row */
+    int subsampling_type;
+    int block_size;                  /* size of the decoded blocks in pixels (8, or 4, 2, 1 when scaled) */
+    int first_MCU;                   /* first MCU output by this thread (start of a restart interval) */
+    int last_MCU;                    /* one past the last MCU */
+    int decode_first, decode_last;   /* MCUs entropy decoded, [first_MCU, last_MCU) and their neighbours */
+    int row_start;                   /* first MCU of the row being decoded */
+    JPEG_REGION* roi;                /* region of the image to output */
+    int roi_first_col, roi_last_col; /* MCU columns overlapping the region */
+    int roi_first_row, roi_last_row; /* MCU rows overlapping the region */
+    JPEG_MCU_COEFF* coeff_row;       /* quantized coefficients of the row being decoded (nW MCUs) */
+    const JPEG_COEFFICIENTS* coeffs; /* if not NULL, the MCUs are read from these planes, not decoded */
+    BYTE* comp_row[3];               /* decoded Y, Cb and Cr samples of the row (nW MCUs) */
+    int comp_stride[3];              /* row stride of each component */
+    JPEG_IDCT_TABLE* idct_tables;    /* quantization tables prepared for the IDCT */
+    int idct_method;
+    bool luma_only;                  /* only the luminance is needed, chrominance blocks are skipped */
+    JPEG_PIXEL_BUFFER* output;       /* where the decoded pixels go */
+    BYTE* line_buffer;               /* 6 lines of the row, used to interleave the pixels */
+
+    /* fancy upsampling */
+    bool fancy_upsampling;
+    int chroma_width, chroma_height; /* chroma samples inside the image */
+    BYTE* prev_comp_row[3];          /* samples of the previous row */
+    int prev_row;                    /* MCU row in "prev_comp_row" (-1: none) */
+    bool pending;                    /* the last line of the previous row waits for the next row */
+    int pending_first_col, pending_last_col;
+    short* colsum;                   /* temporary vertical sums */
+    BYTE* chroma_buffer;             /* 2 lines of upsampled Cb and Cr */
+
+    bool success;
+    char message[_JPEG_MSG_LEN];     /* error message of this thread */
+};
+
+/* MCU columns of "row" that are output by the worker (inside its intervals and the region), false if none */
+bool _jpeg_worker_columns(JPEG_MCU_WORKER* worker, int row, int* first_col, int* last_col) {
+    int nW = worker->nW;
+    int first_row = worker->first_MCU / nW, last_row = (worker->last_MCU - 1) / nW;
+    if (row < first_row || row > last_row || row < worker->roi_first_row || row > worker->roi_last_row)
+        return false;
+    (*first_col) = (row == first_row) ? worker->first_MCU % nW : 0;
+    (*last_col) = (row == last_row) ? (worker->last_MCU - 1) % nW : nW - 1;
+    if ((*first_col) < worker->roi_first_col) (*first_col) = worker->roi_first_col;
+    if ((*last_col) > worker->roi_last_col) (*last_col) = worker->roi_last_col;
+    return (*first_col) <= (*last_col);
+}
+
+/*
+upsample the chroma of a line (fancy upsampling) and convert the line to "output". The
+line is the "line"-th one of MCU row "row", whose samples are in "comp_row". "above"
+and "below" are the samples of the rows above and below, or NULL if not available.
+Only MCU columns first_col ~ last_col are converted.
+*/
+void _jpeg_fancy_line(JPEG_MCU_WORKER* worker, int row, int line, BYTE** comp_row, BYTE** above, BYTE** below,
+    int first_col, int last_col) {
+    int block_size = worker->block_size;
+    int MCU_width, MCU_height;
+    _jpeg_MCU_size(worker->subsampling_type, block_size, &MCU_width, &MCU_height);
+    int hfactor = MCU_width / block_size, vfactor = MCU_height / block_size;
+
+    /* clip against the region */
+    JPEG_REGION* roi = worker->roi;
+    int y = row * MCU_height + line;
+    int x0 = first_col * MCU_width, x1 = (last_col + 1) * MCU_width;
+    if (x0 < roi->x) x0 = roi->x;
+    if (x1 > roi->x + roi->width) x1 = roi->x + roi->width;
+    if (y < roi->y || y >= roi->y + roi->height || x0 >= x1)
+        return;
+
+    /* nearest and next nearest chroma lines */
+    int* stride = worker->comp_stride;
+    int k = line / vfactor;
+    const BYTE* near[2] = { comp_row[1] + k * stride[1], comp_row[2] + k * stride[2] };
+    const BYTE* far[2] = { near[0], near[1] };
+    bool lower = (vfactor == 2 && line % 2 == 1);
+    if (vfactor == 2) {
+        int c = row * block_size + k + (lower ? 1 : -1); /* in the image */
+        BYTE** far_row = comp_row;
+        int far_line = k + (lower ? 1 : -1);
+        if (far_line < 0) {
+            far_row = above;
+            far_line = block_size - 1;
+        }
+        else if (far_line >= block_size) {
+            far_row = below;
+            far_line = 0;
+        }
+        if (c >= 0 && c < worker->chroma_height && far_row != NULL) {
+            far[0] = far_row[1] + far_line * stride[1];
+            far[1] = far_row[2] + far_line * stride[2];
+        }
+    }
+    int line_size = stride[0];
+    const BYTE* Cb = _jpeg_fancy_upsample(near[0], far[0], hfactor, vfactor, lower, x0, x1, worker->chroma_width,
+        worker->colsum, worker->chroma_buffer);
+    const BYTE* Cr = _jpeg_fancy_upsample(near[1], far[1], hfactor, vfactor, lower, x0, x1, worker->chroma_width,
+        worker->colsum, worker->chroma_buffer + line_size + 16);
+
+    /* convert, straight into the planes if possible */
+    JPEG_PIXEL_BUFFER* output = worker->output;
+    const BYTE* Y = comp_row[0] + line * stride[0] + x0;
+    int width = x1 - x0;
+    int offset = (y - roi->y) * output->stride + (x0 - roi->x) * _jpeg_pixel_size(output->format);
+    if (output->format == JPEG_PIXEL_PLANAR_RGB) {
+        _jpeg_YCbCr_to_RGB_row(Y, Cb, Cr, 1, width, output->data[0] + offset, output->data[1] + offset, output->data[2] + offset);
+    }
+    else {
+        BYTE* R = worker->line_buffer, * G = R + line_size, * B = G + line_size;
+        _jpeg_YCbCr_to_RGB_row(Y, Cb, Cr, 1, width, R, G, B);
+        _jpeg_write_line(output, offset, R, G, B, width);
+    }
+}
+
+/* transform and convert a decoded row (MCU columns first_col ~ last_col) with fancy upsampling */
+void _jpeg_finish_row_fancy(JPEG_MCU_WORKER* worker, int row, int first_col, int last_col) {
+    int block_size = worker->block_size;
+    int MCU_width, MCU_height;
+    _jpeg_MCU_size(worker->subsampling_type, block_size, &MCU_width, &MCU_height);
+    int vfactor = MCU_height / block_size;
+
+    /* the MCUs of the region and their neighbours are needed */
+    if (first_col < worker->roi_first_col - 1) first_col = worker->roi_first_col - 1;
+    if (last_col > worker->roi_last_col + 1) last_col = worker->roi_last_col + 1;
+    if (row < worker->roi_first_row - 1 || row > worker->roi_last_row + 1 || first_col > last_col)
+        return;
+    BYTE* comp_row[3] = { /* samples of the first MCU */
+        worker->comp_row[0] + first_col * MCU_width,
+        worker->comp_row[1] + first_col * block_size,
+        worker->comp_row[2] + first_col * block_size
+    };
+    _jpeg_IDCT_MCUs(worker->jfile, &(worker->coeff_row[first_col]), last_col - first_col + 1, worker->subsampling_type,
+        block_size, worker->idct_tables, worker->idct_method, false, comp_row, worker->comp_stride);
+
+    /* the last line of the previous row needs the first chroma line of this one */
+    BYTE** above = (worker->prev_row == row - 1) ? worker->prev_comp_row : NULL;
+    if (above != NULL && worker->pending) {
+        _jpeg_fancy_line(worker, row - 1, MCU_height - 1, worker->prev_comp_row, NULL, worker->comp_row,
+            worker->pending_first_col, worker->pending_last_col);
+    }
+    worker->pending = false;
+
+    /* the lines of this row, but the last one with vertical subsampling */
+    int col0, col1;
+    if (_jpeg_worker_columns(worker, row, &col0, &col1)) {
+        int lines = (vfactor == 2) ? MCU_height - 1 : MCU_height;
+        for (int line = 0; line < lines; line++)
+            _jpeg_fancy_line(worker, row, line, worker->comp_row, above, NULL, col0, col1);
+        if (vfactor == 2) {
+            worker->pending = true;
+            worker->pending_first_col = col0;
+            worker->pending_last_col = col1;
+        }
+    }
+
+    /* this row becomes the previous one */
+    for (int c = 0; c < 3; c++) {
+        BYTE* t = worker->comp_row[c];
+        worker->comp_row[c] = worker->prev_comp_row[c];
+        worker->prev_comp_row[c] = t;
+    }
+    worker->prev_row = row;
+}
+
+/*
+the "i"-th MCU is in the coefficient row: once the row (or the part of it decoded by
+the thread) is complete, it is transformed and converted while it is still in cache
+*/
+void _jpeg_worker_MCU_done(JPEG_MCU_WORKER* worker, int i) {
+    int nW = worker->nW;
+    if (i % nW != nW - 1 && i != worker->decode_last - 1)
+        return;
+    int row_start = worker->row_start;
+    worker->row_start = i + 1;
+    if (worker->fancy_upsampling) {
+        _jpeg_finish_row_fancy(worker, row_start / nW, row_start % nW, i % nW);
+        return;
+    }
+    /* only the MCUs overlapping the region are transformed and converted */
+    int subsampling_type = worker->subsampling_type;
+    int block_size = worker->block_size;
+    int MCU_width, MCU_height, chroma_width, chroma_height;
+    _jpeg_MCU_size(subsampling_type, block_size, &MCU_width, &MCU_height);
+    _jpeg_chroma_size(subsampling_type, block_size, &chroma_width, &chroma_height);
+    int row = row_start / nW;
+    int first_col = row_start % nW, last_col = i % nW;
+    if (first_col < worker->roi_first_col) first_col = worker->roi_first_col;
+    if (last_col > worker->roi_last_col) last_col = worker->roi_last_col;
+    if (row >= worker->roi_first_row && row <= worker->roi_last_row && first_col <= last_col) {
+        int count = last_col - first_col + 1;
+        BYTE* comp_row[3] = { /* samples of the first MCU */
+            worker->comp_row[0] + first_col * MCU_width,
+            worker->comp_row[1] + first_col * chroma_width,
+            worker->comp_row[2] + first_col * chroma_width
+        };
+        _jpeg_IDCT_MCUs(worker->jfile, &(worker->coeff_row[first_col]), count, subsampling_type, block_size,
+            worker->idct_tables, worker->idct_method, worker->luma_only, comp_row, worker->comp_stride);
+        _jpeg_decode_color(comp_row, worker->comp_stride, count, first_col, row, subsampling_type,
+            block_size, worker->roi, worker->output, worker->line_buffer);
+    }
+}
+
+/* after the last MCU of the worker */
+void _jpeg_worker_finish(JPEG_MCU_WORKER* worker) {
+    /* last line of the last row, at the bottom of the image */
+    if (worker->pending) {
+        int MCU_width, MCU_height;
+        _jpeg_MCU_size(worker->subsampling_type, worker->block_size, &MCU_width, &MCU_height);
+        _jpeg_fancy_line(worker, worker->prev_row, MCU_height - 1, worker->prev_comp_row, NULL, NULL,
+            worker->pending_first_col, worker->pending_last_col);
+        worker->pending = false;
+    }
+}
+
+/* thread entry, decode the MCUs assigned to the worker */
+void _jpeg_decode_MCUs_worker(JPEG_MCU_WORKER* worker) {
+    JPEG_FILE* jfile = worker->jfile;
+    int nW = worker->nW;
+    int subsampling_type = worker->subsampling_type;
+
+    JPEG_BIT_READER bit_reader;
+    int prev_DC_coeffs[4] = { 0 }; /* 4 channels at most */
+    worker->success = false;
+    for (int i = worker->decode_first; i < worker->decode_last; i++) { /* for each MCU in raster scan order */
+        if (worker->coeffs != NULL) {
+            _jpeg_load_MCU(worker->coeffs, i, subsampling_type, worker->luma_only, &(worker->coeff_row[i % nW]));
+        }
+        else {
+            if (i == worker->decode_first || (jfile->restart_interval != 0 && i % jfile->restart_interval == 0))
+                _jpeg_start_interval(jfile, i, &bit_reader, prev_DC_coeffs);
+            if (!_jpeg_decode_MCU(jfile, worker->message, &bit_reader, prev_DC_coeffs, &(worker->coeff_row[i % nW]),
+                subsampling_type, worker->luma_only))
+                return;
+        }
+        _jpeg_worker_MCU_done(worker, i);
+    }
+    _jpeg_worker_finish(worker);
+    worker->success = true;
+}
+
+/*
+memory kept between decodes by decoders and batch workers (JPEG_DECODER,
+jpeg_read_batch), so that decoding many images stops allocating once the buffers fit
+the largest image. The buffers only grow, and the IDCT tables prepared for the previous
+image are reused when the next image has the same quantization tables (Huffman tables
+are shared by all images, see _jpeg_get_huffman_table).
+*/
+struct JPEG_SCRATCH {
+    JPEG_MCU_COEFF* coeff_rows;           /* coefficients of a row of MCUs for each thread */
+    int coeff_capacity;                   /* in MCUs */
+    BYTE* sample_rows;                    /* sample rows and line buffers of each thread */
+    int sample_capacity;                  /* in bytes */
+    JPEG_MCU_WORKER* workers;             /* state of each thread */
+    int worker_capacity;
+    short* coeff_planes;                  /* coefficient planes of a progressive image */
+    int coeff_plane_capacity;             /* in coefficients */
+    Array<BYTE> file_data;                /* content of the file being decoded */
+    INT_8x8 qtabs[4];                     /* quantization tables "idct_tables" were prepared from */
+    bool qtab_is_used[4];
+    JPEG_IDCT_TABLE idct_tables[4];
+
+    JPEG_SCRATCH() {
+        coeff_rows = NULL;
+        coeff_capacity = 0;
+        sample_rows = NULL;
+        sample_capacity = 0;
+        workers = NULL;
+        worker_capacity = 0;
+        coeff_planes = NULL;
+        coeff_plane_capacity = 0;
+        for (int i = 0; i < 4; i++)
+            qtab_is_used[i] = false;
+    }
+    ~JPEG_SCRATCH() {
+        free(coeff_rows);
+        free(sample_rows);
+        free(workers);
+        free(coeff_planes);
+    }
+};
+
+/* make "*buffer" hold at least "size" elements of "element_size" bytes, the content is not kept */
+bool _jpeg_reserve(void** buffer, int* capacity, int size, int element_size) {
+    if (size <= (*capacity))
+        return true;
+    void* p = malloc(size_t(size) * element_size);
+    if (p == NULL)
+        return false;
+    free(*buffer);
+    (*buffer) = p;
+    (*capacity) = size;
+    return true;
+}
+
+/*
+set up the threads decoding the MCUs that overlap "roi" (see _jpeg_decode_MCUs), the
+MCUs are shared between the threads by intervals of "restart_interval" MCUs (0: a single
+thread decodes from the first MCU). The workers are kept in the scratch memory and
+"num_threads" receives their number, returns NULL on error.
+*/
+JPEG_MCU_WORKER* _jpeg_prepare_workers(JPEG_FILE* jfile, int nW, int nH, int subsampling_type, int block_size,
+    int* num_threads, int idct_method, int upsampling, JPEG_REGION* roi, JPEG_PIXEL_BUFFER* output,
+    const JPEG_COEFFICIENTS* coeffs, int restart_interval, JPEG_SCRATCH* scratch) {
+
+    /* MCUs overlapping the region */
+    int MCU_width, MCU_height;
+    _jpeg_MCU_size(subsampling_type, block_size, &MCU_width, &MCU_height);
+    int roi_first_col = roi->x / MCU_width, roi_last_col = (roi->x + roi->width - 1) / MCU_width;
+    int roi_first_row = roi->y / MCU_height, roi_last_row = (roi->y + roi->height - 1) / MCU_height;
+    int first_MCU = 0; /* first MCU to decode */
+    int num_MCUs = roi_last_row * nW + roi_last_col + 1; /* MCUs after the region are not needed */
+
+    /* with fancy upsampling, the MCUs around the ones of a thread are decoded as well */
+    bool luma_only = (subsampling_type == 0 || output->format == JPEG_PIXEL_GRAY);
+    /* (the chroma of scaled images is not upsampled, see _jpeg_chroma_size) */
+    bool fancy = (upsampling == JPEG_UPSAMPLING_FANCY && subsampling_type >= 2 && !luma_only && block_size == 8);
+    int context = fancy ? nW + 1 : 0;
+    int decode_MCUs = (num_MCUs + context < nW * nH) ? num_MCUs + context : nW * nH;
+
+    /* each restart interval starts after a RST marker found when scanning the bitstream */
+    int first_interval = 0, num_intervals = 1;
+    if (restart_interval != 0) {
+        first_interval = (roi_first_row * nW + roi_first_col) / restart_interval;
+        num_intervals = (num_MCUs + restart_interval - 1) / restart_interval - first_interval;
+        if (coeffs == NULL && jfile->rst_offsets.size() < (decode_MCUs + restart_interval - 1) / restart_interval - 1) {
+            _jpeg_dump_message(jfile, "missing restart marker.");
+            return NULL;
+        }
+        first_MCU = first_interval * restart_interval;
+    }
+    if ((*num_threads) <= 0)
+        (*num_threads) = int(std::thread::hardware_concurrency());
+    if ((*num_threads) > num_intervals)
+        (*num_threads) = num_intervals;
+    if ((*num_threads) <= 0)
+        (*num_threads) = 1;
+    int num_workers = (*num_threads);
+
+    /* dequantization is done together with the IDCT, the tables of the previous image are kept */
+    for (int t = 0; t < 4; t++) {
+        if (jfile->qtab_bits[t] != 0 && (!scratch->qtab_is_used[t] ||
+            memcmp(&(scratch->qtabs[t]), &(jfile->qtabs[t]), sizeof(INT_8x8)) != 0)) {
+            _jpeg_prepare_IDCT_table(&(jfile->qtabs[t]), &(scratch->idct_tables[t]));
+            scratch->qtabs[t] = jfile->qtabs[t];
+            scratch->qtab_is_used[t] = true;
+        }
+    }
+    JPEG_IDCT_TABLE* idct_tables = scratch->idct_tables;
+
+    /* split the intervals into groups of consecutive intervals, one for each thread */
+    int chroma_width, chroma_height;
+    _jpeg_chroma_size(subsampling_type, block_size, &chroma_width, &chroma_height);
+    int Y_row_size = nW * MCU_width * MCU_height, C_row_size = nW * chroma_width * chroma_height; /* bytes of a row of samples */
+    int line_size = nW * MCU_width;
+    int hfactor = MCU_width / block_size, vfactor = MCU_height / block_size;
+    int image_width = (jfile->image_width * block_size + 7) / 8, image_height = (jfile->image_height * block_size + 7) / 8; /* scaled */
+    int sample_bytes = Y_row_size + 2 * C_row_size;
+    int colsum_offset = ((fancy ? 2 : 1) * sample_bytes + 15) & ~15; /* aligned for the 16-bit sums */
+    int line_offset = colsum_offset + (fancy ? int(sizeof(short)) * (line_size + 32) : 0);
+    int thread_bytes = line_offset + 6 * line_size + (fancy ? 2 * (line_size + 16) : 0);
+    thread_bytes = (thread_bytes + 15) & ~15;
+    if (!_jpeg_reserve((void**)&(scratch->coeff_rows), &(scratch->coeff_capacity), nW * num_workers, sizeof(JPEG_MCU_COEFF)) ||
+        !_jpeg_reserve((void**)&(scratch->sample_rows), &(scratch->sample_capacity), thread_bytes * num_workers, sizeof(BYTE)) ||
+        !_jpeg_reserve((void**)&(scratch->workers), &(scratch->worker_capacity), num_workers, sizeof(JPEG_MCU_WORKER))) {
+        _jpeg_dump_message(jfile, "out of memory.");
+        return NULL;
+    }
+    JPEG_MCU_WORKER* workers = scratch->workers;
+    JPEG_MCU_COEFF* coeff_rows = scratch->coeff_rows;
+    BYTE* sample_rows = scratch->sample_rows;
+    for (int t = 0; t < num_workers; t++) {
+        int worker_first_interval = first_interval + int((long long)num_intervals * t / num_workers);
+        int worker_last_interval = first_interval + int((long long)num_intervals * (t + 1) / num_workers);
+        workers[t].jfile = jfile;
+        workers[t].nW = nW;
+        workers[t].subsampling_type = subsampling_type;
+        workers[t].block_size = block_size;
+        workers[t].first_MCU = (restart_interval != 0) ? worker_first_interval * restart_interval : first_MCU;
+        workers[t].last_MCU = (restart_interval != 0) ? worker_last_interval * restart_interval : num_MCUs;
+        if (workers[t].last_MCU > num_MCUs)
+            workers[t].last_MCU = num_MCUs;
+        /* decoding can only start at the beginning of an interval */
+        workers[t].decode_first = workers[t].first_MCU - context;
+        if (workers[t].decode_first < 0)
+            workers[t].decode_first = 0;
+        if (restart_interval != 0)
+            workers[t].decode_first -= workers[t].decode_first % restart_interval;
+        else
+            workers[t].decode_first = first_MCU;
+        workers[t].decode_last = workers[t].last_MCU + context;
+        if (workers[t].decode_last > decode_MCUs)
+            workers[t].decode_last = decode_MCUs;
+        workers[t].row_start = workers[t].decode_first;
+        workers[t].roi = roi;
+        workers[t].roi_first_col = roi_first_col;
+        workers[t].roi_last_col = roi_last_col;
+        workers[t].roi_first_row = roi_first_row;
+        workers[t].roi_last_row = roi_last_row;
+        workers[t].coeff_row = coeff_rows + nW * t;
+        workers[t].coeffs = coeffs;
+        BYTE* thread_buffer = sample_rows + thread_bytes * t;
+        workers[t].comp_row[0] = thread_buffer;
+        workers[t].comp_row[1] = workers[t].comp_row[0] + Y_row_size;
+        workers[t].comp_row[2] = workers[t].comp_row[1] + C_row_size;
+        workers[t].comp_stride[0] = nW * MCU_width;
+        workers[t].comp_stride[1] = nW * chroma_width;
+        workers[t].comp_stride[2] = nW * chroma_width;
+        workers[t].idct_tables = idct_tables;
+        workers[t].idct_method = idct_method;
+        workers[t].luma_only = luma_only;
+        workers[t].output = output;
+        workers[t].line_buffer = thread_buffer + line_offset;
+        workers[t].fancy_upsampling = fancy;
+        workers[t].chroma_width = (image_width + hfactor - 1) / hfactor;
+        workers[t].chroma_height = (image_height + vfactor - 1) / vfactor;
+        workers[t].prev_comp_row[0] = thread_buffer + sample_bytes;
+        workers[t].prev_comp_row[1] = workers[t].prev_comp_row[0] + Y_row_size;
+        workers[t].prev_comp_row[2] = workers[t].prev_comp_row[1] + C_row_size;
+        workers[t].prev_row = -1;
+        workers[t].pending = false;
+        workers[t].colsum = (short*)(thread_buffer + colsum_offset);
+        workers[t].chroma_buffer = workers[t].line_buffer + 6 * line_size;
+        workers[t].success = false;
+        workers[t].message[0] = '\0';
+    }
+    return workers;
+}
+
+/*
+decode the Huffman bitstream row by row and write the pixels inside "roi" to "output".
+Decoding stops after the last MCU overlapping the region. The MCUs before the region
+still need to be entropy decoded for the DC predictions, unless restart markers
+allow to start right at the interval containing the first MCU of the region.
+If "coeffs" is not NULL (progressive images), the MCUs are read from its planes
+and the bitstream is not used.
+*/
+bool _jpeg_decode_MCUs(JPEG_FILE* jfile, int nW, int nH, int subsampling_type, int block_size, int num_threads,
+    int idct_method, int upsampling, JPEG_REGION* roi, JPEG_PIXEL_BUFFER* output, const JPEG_COEFFICIENTS* coeffs,
+    JPEG_SCRATCH* scratch) {
+
+    JPEG_SCRATCH local_scratch; /* released on return when the caller has no scratch memory */
+    if (scratch == NULL)
+        scratch = &local_scratch;
+
+    /* the planes of coefficients can be read from any MCU: a row is an interval */
+    int restart_interval = (coeffs != NULL) ? nW : jfile->restart_interval;
+    JPEG_MCU_WORKER* workers = _jpeg_prepare_workers(jfile, nW, nH, subsampling_type, block_size, &num_threads,
+        idct_method, upsampling, roi, output, coeffs, restart_interval, scratch);
+    if (workers == NULL)
         return false;
+    if (num_threads == 1) {
+        _jpeg_decode_MCUs_worker(&workers[0]);
+    }
+    else {
+        /* the calling thread decodes the first group */
+        std::thread* threads = new std::thread[num_threads - 1];
+        for (int t = 1; t < num_threads; t++) {
+            threads[t - 1] = std::thread(_jpeg_decode_MCUs_worker, &workers[t]);
+        }
+        _jpeg_decode_MCUs_worker(&workers[0]);
+        for (int t = 1; t < num_threads; t++) {
+            threads[t - 1].join();
+        }
+        delete[] threads;
+    }
+
+    /* report the error that occurs first in the bitstream */
+    bool success = true;
+    for (int t = 0; t < num_threads; t++) {
+        if (!workers[t].success) {
+            _jpeg_dump_message(jfile, workers[t].message);
+            success = false;
+            break;
+        }
     }
+    return success;
+}
+
+/*
+read the markers up to the next SOS marker, whose header is read as well and the
+Huffman bitstream that follows is located. With "headers_only" it stops right after
+the SOS header. After a scan of a progressive JPEG, the EOI marker ends the image
+("scan_num_channels" is then 0).
+*/
+bool _jpeg_read_markers(JPEG_FILE* jfile, JPEG_STREAM* stream, bool headers_only) {
 
+    BYTE marker[2];
     /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
     /* read file in a while loop until EOI marker or EOF is reached  */
     /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
     bool success = false;
     while (true) {
-        if (_jpeg_read_fp(fp, 2, marker) == false) {
+        if (_jpeg_read_stream(stream, 2, marker) == false) {
             _jpeg_dump_message(jfile, "unexpected end of file.");
             return false;
         }
@@ -1396,7 +2984,7 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
         if (marker[1] == 0xFF) {
             /* any number of 0xFF in a row is allowed and should be ignored */
             while (marker[1] == 0xFF) {
-                if (!_jpeg_read_fp(fp, 1, &(marker[1]))) {
+                if (!_jpeg_read_stream(stream, 1, &(marker[1]))) {
                     _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                     return false;
                 }
@@ -1405,22 +2993,22 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
         }
         /* parse markers */
         if (marker[1] >= APP0 && marker[1] <= APP15) {
-            printf("JPEG DEBUG: reading APPN.\n");
-            if (!_jpeg_read_APPN(fp, jfile)) {
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: reading APPN.\n");
+            if (!_jpeg_read_APPN(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
         }
         else if (marker[1] >= JPG0 && marker[1] <= JPG13) {
-            printf("JPEG DEBUG: read JPGN marker.\n");
-            if (!_jpeg_read_JPGN(fp, jfile)) {
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: read JPGN marker.\n");
+            if (!_jpeg_read_JPGN(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
         }
         else if (marker[1] == DNL || marker[1] == DHP || marker[1] == EXP) {
-            printf("JPEG DEBUG: read misc marker.\n");
-            if (!_jpeg_read_NONE(fp, jfile)) {
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: read misc marker.\n");
+            if (!_jpeg_read_NONE(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
@@ -1437,7 +3025,7 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
             return false;
         }
         else if (marker[1] == DQT) {
-            printf("JPEG DEBUG: reading quantization tables.\n");
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: reading quantization tables.\n");
             /* FF DB
                XX XX
                [YY ZZ ... ZZ] x N
@@ -1450,13 +3038,13 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
                ZZ: quantization table data
                64 bytes for 8 bit QT and 128 bytes for 16 bit QT
             */
-            if (!_jpeg_read_QTAB(fp, jfile)) {
+            if (!_jpeg_read_QTAB(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid quantization table.");
                 return false;
             }
         }
-        else if (marker[1] == SOF0) {
-            printf("JPEG DEBUG: reading start of frame.\n");
+        else if (marker[1] == SOF0 || marker[1] == SOF2) {
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: reading start of frame.\n");
             /*
             FF CX : C0~C15, marker
             XX XX : length (including this 2 bytes)
@@ -1472,15 +3060,13 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
             XX    : quantization table ID used for this channel
             } x N
             */
-            if (!_jpeg_read_SOF0(fp, jfile)) {
+            /* a progressive frame (SOF2) has the same header, only the scans differ */
+            jfile->is_progressive = (marker[1] == SOF2);
+            if (!_jpeg_read_SOF0(stream, jfile)) {
                 _jpeg_dump_message(jfile, "corrupted JPEG SOF0 marker.");
                 return false;
             }
         }
-        else if (marker[1] == SOF2) {
-            _jpeg_dump_message(jfile, "progressive JPEGs are not supported.");
-            return false;
-        }
         else if (marker[1] == SOF1 || marker[1] == SOF3 || (marker[1] >= SOF5 && marker[1] <= SOF7) ||
             (marker[1] >= SOF9 && marker[1] <= SOF11) || (marker[1] >= SOF13 && marker[1] <= SOF15)) {
             _jpeg_dump_message(jfile, "unsupported JPEG frame type.");
@@ -1488,19 +3074,19 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
         }
         else if (marker[1] == DRI) {
             /* define restart interval for the DC coefficient in the MCU */
-            printf("JPEG DEBUG: define restart interval.\n");
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: define restart interval.\n");
             /*
             FF DD
             00 04 : length = 4
             XX XX : restart interval
             */
-            if (!_jpeg_read_DRI(fp, jfile)) {
+            if (!_jpeg_read_DRI(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
         }
         else if (marker[1] == DHT) {
-            printf("JPEG DEBUG: define Huffman tables.\n");
+            _JPEG_DEBUG_PRINT("JPEG DEBUG: define Huffman tables.\n");
             /*
             FF C4 : marker
             XX XX : length
@@ -1522,7 +3108,7 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
             [X bytes]  : actual symbols
             } x N
             */
-            if (!_jpeg_read_DHT(fp, jfile)) {
+            if (!_jpeg_read_DHT(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
@@ -1550,19 +3136,23 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
             NOTE: markers can show up in bitstream
             such as RST0~RST7, just skip them
             */
-            if (!_jpeg_read_SOS(fp, jfile)) {
+            if (!_jpeg_read_SOS(stream, jfile, headers_only)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
             return true;
         }
         else if (marker[1] == EOI) {
+            if (jfile->num_scans > 0) { /* after the last scan of a progressive JPEG */
+                jfile->scan_num_channels = 0;
+                return true;
+            }
             _jpeg_dump_message(jfile, "unexpected end of image (EOI) marker.");
             return false;
         }
         else {
-            printf("JPEG warning: unhandled marker '0xFF%02X'.\n", marker[1]);
-            if (!_jpeg_read_NONE(fp, jfile)) {
+            _JPEG_DEBUG_PRINT("JPEG warning: unhandled marker '0xFF%02X'.\n", marker[1]);
+            if (!_jpeg_read_NONE(stream, jfile)) {
                 _jpeg_dump_message(jfile, "invalid JPEG image marker.");
                 return false;
             }
@@ -1572,6 +3162,52 @@ bool _jpeg_read_file(JPEG_FILE* jfile, FILE* fp) {
     return false; /* this line should not be reached */
 }
 
+/*
+the JPEG main reading function, reads the markers and locates the Huffman bitstream.
+With "headers_only" it stops right after the SOS header.
+*/
+bool _jpeg_read_file(JPEG_FILE* jfile, JPEG_STREAM* stream, bool headers_only) {
+
+    /* initialize header information */
+    jfile->image_data = NULL;
+    jfile->is_valid = false;
+    jfile->zero_start = false; /* default */
+    jfile->image_width = 0;
+    jfile->image_height = 0;
+    jfile->output_width = 0;
+    jfile->output_height = 0;
+    jfile->message[0] = '\0';
+    jfile->restart_interval = 0;
+    jfile->scan_offset = 0;
+    jfile->hstream = NULL;
+    jfile->hstream_size = 0;
+    jfile->num_channels = 0;
+    jfile->is_progressive = false;
+    jfile->num_scans = 0;
+    jfile->scan_num_channels = 0;
+    /* the content of a table is only read once its marker is found (is_used), */
+    /* so that a reused JPEG_FILE is not cleared table by table */
+    for (int i = 0; i < 4; i++) {
+        jfile->channels[i].is_used = false;
+        jfile->qtab_bits[i] = 0;
+        jfile->actabs[i].is_used = false;
+        jfile->dctabs[i].is_used = false;
+        jfile->actab_decode[i] = NULL;
+        jfile->dctab_decode[i] = NULL;
+    }
+
+    BYTE marker[2];
+    /* JPEG markers are two bytes long */
+    _jpeg_read_stream(stream, 2, marker); /* read 2 bytes to marker */
+
+    if (marker[0] != 0xFF || marker[1] != SOI) {
+        _jpeg_dump_message(jfile, "invalid JPEG image marker.");
+        return false;
+    }
+
+    return _jpeg_read_markers(jfile, stream, headers_only);
+}
+
 
 /* encode JPEG MCU coefficients to JPEG bitstream */
 void _jpeg_encode_integer(int i, Bitstream* _bitstream) {
@@ -1604,6 +3240,45 @@ void _jpeg_encode_integer(int i, Bitstream* _bitstream) {
     _bitstream->appendBits(t, bits);
 }
 
+/* list the blocks of an MCU in coding order (Y0~Y3, Cb, Cr) for the chroma subsampling */
+/* type of the image, "components" receives the component of each block (0: Y, 1: Cb, */
+/* 2: Cr), returns the number of blocks */
+int _jpeg_QCOEFF_blocks(JPEG_MCU_QCOEFF* MCU, int subsampling_type, INT_8x8** blocks, int** diffs, int* components) {
+    INT_8x8* Y_blocks[4] = { &(MCU->Y0), &(MCU->Y1), &(MCU->Y2), &(MCU->Y3) };
+    int* Y_diffs[4] = { &(MCU->Y0_diff), &(MCU->Y1_diff), &(MCU->Y2_diff), &(MCU->Y3_diff) };
+    int num_Y_blocks = 1;
+    if (subsampling_type == 2 || subsampling_type == 3) num_Y_blocks = 2;
+    else if (subsampling_type == 4) num_Y_blocks = 4;
+    int n = 0;
+    for (int b = 0; b < num_Y_blocks; b++, n++) {
+        blocks[n] = Y_blocks[b]; diffs[n] = Y_diffs[b]; components[n] = 0;
+    }
+    if (subsampling_type != 0) {
+        blocks[n] = &(MCU->Cb); diffs[n] = &(MCU->Cb_diff); components[n] = 1; n++;
+        blocks[n] = &(MCU->Cr); diffs[n] = &(MCU->Cr_diff); components[n] = 2; n++;
+    }
+    return n;
+}
+
+/* replace the DC coefficient of each block by its difference with the DC coefficient of */
+/* the previous block of the same component, the prediction restarts at every restart */
+/* interval (0: no restart interval) */
+void _jpeg_differentiate_DC(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs, int subsampling_type, int restart_interval) {
+    int prev_DC[3] = { 0 };
+    for (int i = 0; i < qCoeffs->sizeX() * qCoeffs->sizeY(); i++) {
+        if (i == 0 || (restart_interval != 0 && i % restart_interval == 0))
+            prev_DC[0] = prev_DC[1] = prev_DC[2] = 0;
+        INT_8x8* blocks[6]; int* diffs[6]; int components[6];
+        int n = _jpeg_QCOEFF_blocks(&(qCoeffs->data()[i]), subsampling_type, blocks, diffs, components);
+        for (int b = 0; b < n; b++) {
+            int DC = blocks[b]->data[0][0];
+            *(diffs[b]) = prev_DC[components[b]];
+            blocks[b]->data[0][0] = DC - prev_DC[components[b]];
+            prev_DC[components[b]] = DC;
+        }
+    }
+}
+
 /* run forward JPEG encoding */
 void _jpeg_forward_compression(RAW_IMAGE* image, JPEG_SAVE_OPTION* option, int restart_interval,
     FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs) {
@@ -1683,31 +3358,7 @@ void _jpeg_forward_compression(RAW_IMAGE* image, JPEG_SAVE_OPTION* option, int r
     }
 
     /* remember the DC coefficient is relative */
-    for (int i = 0; i < nW*nH; i++) {
-        if (i%restart_interval != 0)
-            qCoeffs->data()[i].Y0_diff = qCoeffs->data()[i - 1].Y3.data[0][0];
-        else
-            qCoeffs->data()[i].Y0_diff = 0;
-        qCoeffs->data()[i].Y1_diff = qCoeffs->data()[i].Y0.data[0][0];
-        qCoeffs->data()[i].Y2_diff = qCoeffs->data()[i].Y1.data[0][0];
-        qCoeffs->data()[i].Y3_diff = qCoeffs->data()[i].Y2.data[0][0];
-        if (i%restart_interval != 0) { /* not restart, calculate relative DC value change */
-            qCoeffs->data()[i].Cb_diff = qCoeffs->data()[i - 1].Cb.data[0][0];
-            qCoeffs->data()[i].Cr_diff = qCoeffs->data()[i - 1].Cr.data[0][0];
-        }
-        else {
-            qCoeffs->data()[i].Cb_diff = 0;
-            qCoeffs->data()[i].Cr_diff = 0;
-        }
-    }
-    for (int i = 0; i < nW*nH; i++) {
-        qCoeffs->data()[i].Y0.data[0][0] -= qCoeffs->data()[i].Y0_diff;
-        qCoeffs->data()[i].Y1.data[0][0] -= qCoeffs->data()[i].Y1_diff;
-        qCoeffs->data()[i].Y2.data[0][0] -= qCoeffs->data()[i].Y2_diff;
-        qCoeffs->data()[i].Y3.data[0][0] -= qCoeffs->data()[i].Y3_diff;
-        qCoeffs->data()[i].Cb.data[0][0] -= qCoeffs->data()[i].Cb_diff;
-        qCoeffs->data()[i].Cr.data[0][0] -= qCoeffs->data()[i].Cr_diff;
-    }
+    _jpeg_differentiate_DC(qCoeffs, 4, restart_interval);
 
 }
 
@@ -1927,7 +3578,7 @@ void _jpeg_reassign_huffman_code(Array<BYTE>* symbols, Array<int> bins, Array<Bi
     codes->clear();
     unsigned int current_code = 0;
     int bits = 1;
-    int clen;
+    int clen = 17; /* length of the shortest code, 17 if there is none */
     for (int i = 1; i < bins.size(); i++) {
         if (bins[i] != 0) {
             clen = i;
@@ -1949,8 +3600,9 @@ void _jpeg_reassign_huffman_code(Array<BYTE>* symbols, Array<int> bins, Array<Bi
     }
 }
 
-/* generate Huffman DC table during forward compression */
-void _jpeg_generate_huffman_tables(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
+/* generate Huffman DC table during forward compression, from the blocks of the */
+/* components in "component_mask" (bit 0: Y, bit 1: Cb, bit 2: Cr) */
+void _jpeg_generate_huffman_tables(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs, int subsampling_type, int component_mask,
     Array<BYTE>* _DC_symbols, Array<Bitstream>* _DC_codes, Array<int>* _DC_bins,
     Array<BYTE>* _AC_symbols, Array<Bitstream>* _AC_codes, Array<int>* _AC_bins) {
 
@@ -1963,18 +3615,14 @@ void _jpeg_generate_huffman_tables(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
     Array<Bitstream>  DC_codes, AC_codes;
     for (int i = 0; i < nW * nH; i++) { /* collect all DC/AC Huffman symbols */
         int coeffs[64];
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y0), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y1), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y2), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y3), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Cb), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Cr), coeffs);
-        _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
+        INT_8x8* blocks[6]; int* diffs[6]; int components[6];
+        int n = _jpeg_QCOEFF_blocks(&(qCoeffs->data()[i]), subsampling_type, blocks, diffs, components);
+        for (int b = 0; b < n; b++) {
+            if ((component_mask & (1 << components[b])) == 0)
+                continue;
+            _jpeg_zz_int8x8_to_intarr(blocks[b], coeffs);
+            _jpeg_RLE_collect_symbols(coeffs, &DC_symbols, &AC_symbols);
+        }
     }
     /* build Huffman trees from all symbols */
     for (int i = 0; i < DC_symbols.size(); i++) {
@@ -2058,10 +3706,12 @@ void _jpeg_generate_huffman_tables(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
     //}
 }
 
-void _jpeg_generate_huffman_bitstream(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
+/* the Huffman tables are arrays indexed by table ID, "component_tables" gives the table */
+/* ID of each component (NULL: table 0 for all) */
+void _jpeg_generate_huffman_bitstream(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs, int subsampling_type,
     Array<BYTE>* DC_symbols, Array<Bitstream>* DC_codes,
     Array<BYTE>* AC_symbols, Array<Bitstream>* AC_codes,
-    int restart_interval, Bitstream* bs) {
+    const int* component_tables, int restart_interval, Bitstream* bs) {
 
     int nW = qCoeffs->sizeX();
     int nH = qCoeffs->sizeY();
@@ -2072,21 +3722,16 @@ void _jpeg_generate_huffman_bitstream(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
 
     Bitstream MCU_bs; /* bitstream generated for MCUs */
     for (int i = 0; i < nW * nH; i++) {
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y0), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y1), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y2), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Y3), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Cb), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
-        _jpeg_zz_int8x8_to_intarr(&(qCoeffs->data()[i].Cr), coeffs);
-        _jpeg_RLE_as_bitstream(coeffs, DC_symbols, DC_codes, AC_symbols, AC_codes, &MCU_bs);
+        INT_8x8* blocks[6]; int* diffs[6]; int components[6];
+        int n = _jpeg_QCOEFF_blocks(&(qCoeffs->data()[i]), subsampling_type, blocks, diffs, components);
+        for (int b = 0; b < n; b++) {
+            int t = (component_tables != NULL) ? component_tables[components[b]] : 0;
+            _jpeg_zz_int8x8_to_intarr(blocks[b], coeffs);
+            _jpeg_RLE_as_bitstream(coeffs, DC_symbols + t, DC_codes + t, AC_symbols + t, AC_codes + t, &MCU_bs);
+        }
         /* MCU encoding complete */
         MCU_remains_before_RST--;
-        if (MCU_remains_before_RST == 0) { /* need to insert RST* marker */
+        if (restart_interval != 0 && MCU_remains_before_RST == 0) { /* need to insert RST* marker */
             MCU_remains_before_RST = restart_interval;
             /* pad bit "1" to achieve byte alignment if we are going to insert the RST marker */
             MCU_bs.alignWrite(1);
@@ -2128,153 +3773,2153 @@ void _jpeg_generate_huffman_bitstream(FixedArray2D<JPEG_MCU_QCOEFF>* qCoeffs,
 
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * */
-/* here are the interface functions for JPEG IO  */
-/* * * * * * * * * * * * * * * * * * * * * * * * */
+/* write a DHT marker defining the DC and the AC Huffman table with ID "table_id" */
+void _jpeg_write_huffman_tables(Bitstream* jpeg, int table_id,
+    Array<BYTE>* DC_symbols, Array<int>* DC_bins,
+    Array<BYTE>* AC_symbols, Array<int>* AC_bins) {
+
+    JPEG_HUFFMAN_TABLE dctab, actab;
+    /* fill the dc and ac table */
+    dctab.offsets[0] = 0; actab.offsets[0] = 0;
+    for (int i = 1; i < 17; i++)
+        dctab.offsets[i] = dctab.offsets[i - 1] + DC_bins->at(i);
+    for (int i = 1; i < 17; i++)
+        actab.offsets[i] = actab.offsets[i - 1] + AC_bins->at(i);
+    for (int i = 0; i < DC_symbols->size(); i++)
+        dctab.symbols[i] = DC_symbols->at(i);
+    for (int i = 0; i < AC_symbols->size(); i++)
+        actab.symbols[i] = AC_symbols->at(i);
+    /* write to bitstream */
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(DHT, 8);
+    int tab_len = 2 + (1 + 16 + dctab.offsets[16]) +
+        (1 + 16 + actab.offsets[16]); /* 2 tables */
+    jpeg->appendBits(WORD(tab_len), 16);
+    /* DC huffman table */
+    jpeg->appendBits(0, 4); /* DC Huffman table */
+    jpeg->appendBits(table_id, 4); /* table ID */
+    for (int i = 0; i < 16; i++)
+        jpeg->appendBits(BYTE(dctab.offsets[i + 1] - dctab.offsets[i]), 8);
+    for (int i = 0; i < dctab.offsets[16]; i++)
+        jpeg->appendBits(dctab.symbols[i], 8);
+    /* AC huffman table */
+    jpeg->appendBits(1, 4); /* AC Huffman table */
+    jpeg->appendBits(table_id, 4); /* table ID */
+    for (int i = 0; i < 16; i++)
+        jpeg->appendBits(BYTE(actab.offsets[i + 1] - actab.offsets[i]), 8);
+    for (int i = 0; i < actab.offsets[16]; i++)
+        jpeg->appendBits(actab.symbols[i], 8);
+}
 
 /*
-jpeg_read: read and decode a JPEG image file.
+decoding tables for every Huffman table, shared with the previous images that used the
+same tables, or generated for this image. Progressive JPEGs can define tables between
+scans, the tables are then prepared again for each scan.
+*/
+bool _jpeg_prepare_huffman_tables(JPEG_FILE* jfile)
+{
+    for (int i = 0; i < 4; i++) {
+        jfile->dctab_decode[i] = jfile->dctabs[i].is_used ? _jpeg_get_huffman_table(&(jfile->dctabs[i])) : NULL;
+        jfile->actab_decode[i] = jfile->actabs[i].is_used ? _jpeg_get_huffman_table(&(jfile->actabs[i])) : NULL;
+        if ((jfile->dctabs[i].is_used && jfile->dctab_decode[i] == NULL) ||
+            (jfile->actabs[i].is_used && jfile->actab_decode[i] == NULL)) {
+            _jpeg_dump_message(jfile, "invalid Huffman table.");
+            return false;
+        }
+    }
+    return true;
+}
 
-* If loading success, "is_valid" will be set to true, and
-  "image_data" contains the decoded raw image data (RGB).
-* Return NULL pointer if file does not exist or out of memory.
-* now the program can only read baseline JPEGs.
-* example:
+/*
+prepare the entropy decoding of an image whose headers have been read: the Huffman
+decoding tables, the chroma subsampling type and the number of MCUs in a row ("nW")
+and in a column ("nH").
+*/
+bool _jpeg_prepare_frame(JPEG_FILE* jfile, int* subsampling_type, int* nW, int* nH)
+{
+    if (!_jpeg_prepare_huffman_tables(jfile)) {
+        return false;
+    }
 
-    JPEG_FILE* jfile = jpeg_read("example.jpg");
-    if (jfile == NULL){
-        printf("error, file not exist or out of memory.\n");
+    /* guess chroma subsampling type */
+    int hsample = 0, vsample = 0;
+    if (jfile->num_channels == 1) {
+        /* grayscale images have a non-interleaved scan: every MCU is a */
+        /* single 8x8 block, whatever the sampling factors are */
+        hsample = vsample = 1;
     }
-    else if (jfile->is_valid == false) {
-        printf("error when loading JPEG file: %s\n", jfile->message);
-        ...
+    else if (jfile->num_channels == 3) {
+        for (int ch = 0; ch < 4; ch++) {
+            if (jfile->channels[ch].is_used) {
+                if (hsample < jfile->channels[ch].hsample)
+                    hsample = jfile->channels[ch].hsample;
+                if (vsample < jfile->channels[ch].vsample)
+                    vsample = jfile->channels[ch].vsample;
+            }
+        }
     }
     else {
-        save_PPM(jfile->image_data, "example.ppm");
-        ...
+        _jpeg_dump_message(jfile, "unsupported number of channels.");
+        return false;
+    }
+    /* the tables used by the scans of progressive JPEGs are checked scan by scan */
+    for (int ch = 0; ch < jfile->num_channels && !jfile->is_progressive; ch++) {
+        int dctab_id = jfile->channels[ch].dctab_id, actab_id = jfile->channels[ch].actab_id;
+        if (dctab_id < 0 || dctab_id > 3 || actab_id < 0 || actab_id > 3 ||
+            jfile->dctab_decode[dctab_id] == NULL || jfile->actab_decode[actab_id] == NULL) {
+            _jpeg_dump_message(jfile, "missing Huffman table.");
+            return false;
+        }
+    }
+    if (hsample != 1 && hsample != 2) {
+        _jpeg_dump_message(jfile, "unsupported chroma subsampling.");
+        return false;
+    }
+    if (vsample != 1 && vsample != 2) {
+        _jpeg_dump_message(jfile, "unsupported chroma subsampling.");
+        return false;
     }
+    if (jfile->num_channels == 1)
+        (*subsampling_type) = 0; /* grayscale, luminance only */
+    else if (hsample == 1 && vsample == 1)
+        (*subsampling_type) = 1; /* no subsampling */
+    else if (hsample == 2 && vsample == 1)
+        (*subsampling_type) = 2; /* horizontal subsampling */
+    else if (hsample == 1 && vsample == 2)
+        (*subsampling_type) = 3; /* vertical subsampling */
+    else
+        (*subsampling_type) = 4; /* horizontal and vertical subsampling */
+
+    /* number of MCUs in a row and in a column */
+    if (hsample == 1) (*nW) = (jfile->image_width + 7) / 8;
+    else (*nW) = (jfile->image_width + 15) / 16;
+    if (vsample == 1) (*nH) = (jfile->image_height + 7) / 8;
+    else (*nH) = (jfile->image_height + 15) / 16;
+    return true;
+}
+
+/*
+read the headers of a JPEG image held in memory and prepare the entropy decoding, see
+_jpeg_prepare_frame()
 */
-JPEG_API JPEG_FILE* jpeg_read(const char * file)
+bool _jpeg_prepare_decode(JPEG_FILE* jfile, const BYTE* data, int size, int* subsampling_type, int* nW, int* nH)
 {
-    FILE* fp = NULL;
-    if ((fp = fopen(file, "rb")) == NULL) {
-        return NULL;
-    }
+    JPEG_STREAM stream;
+    stream.data = data;
+    stream.size = size;
+    stream.pos = 0;
+
     /* read JPEG file header */
-    JPEG_FILE * jfile = new JPEG_FILE();
-    if (jfile == NULL) {
-        fclose(fp);
-        return NULL; /* memory is full */
+    if (!_jpeg_read_file(jfile, &stream, false)) {
+        return false;
     }
+    return _jpeg_prepare_frame(jfile, subsampling_type, nW, nH);
+}
 
-    if (!_jpeg_read_file(jfile, fp)) {
-        goto jpeg_read_error;
+/*
+fill in the layout of the coefficient planes of an image, the planes are not allocated.
+The luminance blocks of an MCU are stored at (2 * mcu_x + 0/1, 2 * mcu_y + 0/1) in the
+order Y0, Y1, Y2, Y3 (Y1 is below Y0 with vertical subsampling only).
+*/
+void _jpeg_layout_coefficients(JPEG_FILE* jfile, int nW, int nH, int subsampling_type, JPEG_COEFFICIENTS* coeffs)
+{
+    int hfactor = (subsampling_type == 2 || subsampling_type == 4) ? 2 : 1;
+    int vfactor = (subsampling_type == 3 || subsampling_type == 4) ? 2 : 1;
+    int num_planes = (subsampling_type == 0) ? 1 : 3;
+    coeffs->image_width = jfile->image_width;
+    coeffs->image_height = jfile->image_height;
+    coeffs->num_channels = jfile->num_channels;
+    coeffs->max_hsample = hfactor;
+    coeffs->max_vsample = vfactor;
+    coeffs->MCUs_per_row = nW;
+    coeffs->MCU_rows = nH;
+    coeffs->restart_interval = jfile->restart_interval;
+    for (int t = 0; t < 4; t++) {
+        coeffs->qtabs[t] = jfile->qtabs[t];
+        coeffs->qtab_bits[t] = jfile->qtab_bits[t];
     }
+    for (int ch = 0; ch < num_planes; ch++) {
+        JPEG_COEFF_PLANE* plane = &(coeffs->planes[ch]);
+        plane->hsample = (ch == 0) ? hfactor : 1;
+        plane->vsample = (ch == 0) ? vfactor : 1;
+        plane->qtab_id = jfile->channels[ch].qtab_id;
+        plane->width_in_blocks = nW * plane->hsample;
+        plane->height_in_blocks = nH * plane->vsample;
+    }
+}
 
-    /* * * * * * * * * * * * * * * * * * * * * * * */
-    /* decode Huffman bitstream and fill MCU array */
-    /* * * * * * * * * * * * * * * * * * * * * * * */
-
-    /* generate code for every Huffman symbol */
-    for (int i = 0; i < 4; i++) {
-        if (jfile->dctabs[i].is_used) {
-            _jpeg_generate_huffman_codes(&(jfile->dctabs[i]));
+/*
+decode a block of a progressive scan, "block" holds the coefficients of the previous
+scans (natural order). Depending on the scan:
+  * DC first scan:     DC difference, scaled by 2^Al
+  * DC refinement:     one more bit of the DC coefficient
+  * AC first scan:     coefficients Ss~Se, scaled by 2^Al, or part of a run of empty
+                       bands (EOBRUN) spanning several blocks
+  * AC refinement:     one more bit of the nonzero coefficients, and the coefficients
+                       that become nonzero (+/- 2^Al)
+*/
+bool _jpeg_decode_progressive_block(JPEG_FILE* jfile, JPEG_BIT_READER* bit_reader, int ch, short* block,
+    int* prev_DC_coeffs, int* eob_run) {
+    int start = jfile->scan_start, end = jfile->scan_end, low = jfile->scan_low;
+    if (start == 0) {
+        if (jfile->scan_high != 0) { /* DC refinement */
+            if (_jpeg_bit_reader_get(bit_reader, 1))
+                block[0] |= short(1 << low);
+            return true;
+        }
+        BYTE length = _jpeg_read_huffman_symbol(bit_reader, jfile->dctab_decode[jfile->channels[ch].dctab_id]);
+        if (length > 11) {
+            _jpeg_dump_message(jfile, "invalid Huffman table symbol.");
+            return false; /* includes 0xFF */
         }
-        if (jfile->actabs[i].is_used) {
-            _jpeg_generate_huffman_codes(&(jfile->actabs[i]));
+        int coeff = _jpeg_bit_reader_get(bit_reader, length);
+        if (length != 0 && coeff < (1 << (length - 1))) {
+            coeff -= (1 << length) - 1;
         }
+        prev_DC_coeffs[ch] += coeff;
+        block[0] = short(prev_DC_coeffs[ch] * (1 << low));
+        return true;
     }
 
-    /* guess chroma subsampling type */
-    int hsample = 0, vsample = 0;
-    for (int ch = 0; ch < 4; ch++) {
-        if (jfile->channels[ch].is_used) {
-            if (hsample < jfile->channels[ch].hsample)
-                hsample = jfile->channels[ch].hsample;
-            if (vsample < jfile->channels[ch].vsample)
-                vsample = jfile->channels[ch].vsample;
-        }
-    }
-    if (hsample != 1 && hsample != 2)
-        goto jpeg_read_error;
-    if (vsample != 1 && vsample != 2)
-        goto jpeg_read_error;
-    int subsampling_type = 0;
-    if (hsample == 1 && vsample == 1)
-        subsampling_type = 1; /* no subsampling */
-    else if (hsample == 2 && vsample == 1)
-        subsampling_type = 2; /* horizontal subsampling */
-    else if (hsample == 1 && vsample == 2)
-        subsampling_type = 3; /* vertical subsampling */
-    else if (hsample == 2 && vsample == 2)
-        subsampling_type = 4; /* horizontal and vertical subsampling */
+    const JPEG_HUFFMAN_TABLE* actab = jfile->actab_decode[jfile->channels[ch].actab_id];
+    if (jfile->scan_high == 0) { /* AC first scan */
+        if ((*eob_run) > 0) {
+            (*eob_run)--;
+            return true;
+        }
+        for (int k = start; k <= end; k++) {
+            BYTE symbol = _jpeg_read_huffman_symbol(bit_reader, actab);
+            if (symbol == 0xFF) {
+                _jpeg_dump_message(jfile, "invalid Huffman table symbol.");
+                return false;
+            }
+            int run = symbol >> 4, length = symbol & 0x0F;
+            if (length != 0) {
+                k += run;
+                if (k > end || length > 10) {
+                    _jpeg_dump_message(jfile, "invalid AC coefficient in progressive scan.");
+                    return false;
+                }
+                int coeff = _jpeg_bit_reader_get(bit_reader, length);
+                if (coeff < (1 << (length - 1))) {
+                    coeff -= (1 << length) - 1;
+                }
+                block[_jpeg_zz_natural[k]] = short(coeff * (1 << low));
+            }
+            else if (run == 15) { /* 16 zeros */
+                k += 15;
+            }
+            else { /* end of band, for this block and the next (2^run - 1 + extra bits) ones */
+                (*eob_run) = (1 << run) - 1;
+                if (run != 0)
+                    (*eob_run) += _jpeg_bit_reader_get(bit_reader, run);
+                break;
+            }
+        }
+        return true;
+    }
 
-    /* allocate, decode and dequantize all MCUs */
-    int nW, nH;
-    if (hsample == 1) nW = (jfile->image_width + 7) / 8;
-    else nW = (jfile->image_width + 15) / 16;
-    if (vsample == 1) nH = (jfile->image_height + 7) / 8;
-    else nH = (jfile->image_height + 15) / 16;
-    JPEG_MCU* all_MCUs = (JPEG_MCU*)malloc(sizeof(JPEG_MCU) * nW * nH);
-    if (all_MCUs == NULL) { /* fatal memory error */
-        goto jpeg_read_error;
+    /* AC refinement: the zero coefficients skipped by a run are the ones that were */
+    /* zero so far, every nonzero coefficient passed over gets a correction bit */
+    short p1 = short(1 << low), m1 = short(-(1 << low));
+    int k = start;
+    if ((*eob_run) == 0) {
+        for (; k <= end; k++) {
+            BYTE symbol = _jpeg_read_huffman_symbol(bit_reader, actab);
+            if (symbol == 0xFF) {
+                _jpeg_dump_message(jfile, "invalid Huffman table symbol.");
+                return false;
+            }
+            int run = symbol >> 4, length = symbol & 0x0F;
+            short value = 0;
+            if (length != 0) {
+                if (length != 1) {
+                    _jpeg_dump_message(jfile, "invalid AC coefficient in progressive scan.");
+                    return false;
+                }
+                value = _jpeg_bit_reader_get(bit_reader, 1) ? p1 : m1;
+            }
+            else if (run != 15) { /* end of band */
+                (*eob_run) = 1 << run;
+                if (run != 0)
+                    (*eob_run) += _jpeg_bit_reader_get(bit_reader, run);
+                break; /* the rest of the block is refined below */
+            }
+            /* skip "run" zero coefficients (16 for ZRL), the new one goes after them */
+            for (; k <= end; k++) {
+                short* coeff = &(block[_jpeg_zz_natural[k]]);
+                if (*coeff != 0) {
+                    if (_jpeg_bit_reader_get(bit_reader, 1) && ((*coeff) & p1) == 0)
+                        (*coeff) += ((*coeff) >= 0) ? p1 : m1;
+                }
+                else if (--run < 0) {
+                    break;
+                }
+            }
+            if (value != 0) {
+                if (k > end) {
+                    _jpeg_dump_message(jfile, "invalid AC coefficient in progressive scan.");
+                    return false;
+                }
+                block[_jpeg_zz_natural[k]] = value;
+            }
+        }
     }
-    if (!_jpeg_decode_MCUs(jfile, nW, nH, all_MCUs, subsampling_type)) {
-        free(all_MCUs);
-        goto jpeg_read_error;
+    if ((*eob_run) > 0) {
+        /* in a run of empty bands, only the nonzero coefficients are refined */
+        for (; k <= end; k++) {
+            short* coeff = &(block[_jpeg_zz_natural[k]]);
+            if (*coeff != 0 && _jpeg_bit_reader_get(bit_reader, 1) && ((*coeff) & p1) == 0)
+                (*coeff) += ((*coeff) >= 0) ? p1 : m1;
+        }
+        (*eob_run)--;
     }
+    return true;
+}
 
+/*
+decode the scan of a progressive JPEG whose header has just been read into the
+coefficient planes. DC scans can interleave several components (MCUs, as baseline
+images), AC scans have a single component whose blocks are coded one by one, in
+raster order and only inside the component (the blocks that only pad the MCUs are
+not coded).
+*/
+bool _jpeg_decode_scan(JPEG_FILE* jfile, JPEG_COEFFICIENTS* coeffs)
+{
+    int start = jfile->scan_start, end = jfile->scan_end;
+    int high = jfile->scan_high, low = jfile->scan_low;
+    if (start > end || end > 63 || (start == 0 && end != 0) || (start != 0 && jfile->scan_num_channels != 1) ||
+        high > 13 || low > 13) {
+        _jpeg_dump_message(jfile, "invalid progressive scan parameters.");
+        return false;
+    }
+    for (int c = 0; c < jfile->scan_num_channels; c++) {
+        JPEG_CHANNEL* channel = &(jfile->channels[jfile->scan_channels[c]]);
+        if ((start == 0 && high == 0 && jfile->dctab_decode[channel->dctab_id] == NULL) ||
+            (start != 0 && jfile->actab_decode[channel->actab_id] == NULL)) {
+            _jpeg_dump_message(jfile, "missing Huffman table.");
+            return false;
+        }
+    }
 
+    /* coded units: MCUs of an interleaved scan, or blocks of a component */
+    int nW = coeffs->MCUs_per_row;
+    int units_per_row = nW, num_units = nW * coeffs->MCU_rows;
+    JPEG_COEFF_PLANE* plane = &(coeffs->planes[jfile->scan_channels[0]]);
+    if (jfile->scan_num_channels == 1) {
+        int width = (coeffs->image_width * plane->hsample + coeffs->max_hsample - 1) / coeffs->max_hsample;
+        int height = (coeffs->image_height * plane->vsample + coeffs->max_vsample - 1) / coeffs->max_vsample;
+        units_per_row = (width + 7) / 8;
+        num_units = units_per_row * ((height + 7) / 8);
+    }
+    if (jfile->restart_interval != 0 &&
+        jfile->rst_offsets.size() < (num_units + jfile->restart_interval - 1) / jfile->restart_interval - 1) {
+        _jpeg_dump_message(jfile, "missing restart marker.");
+        return false;
+    }
 
+    JPEG_BIT_READER bit_reader;
+    int prev_DC_coeffs[4] = { 0 };
+    int eob_run = 0;
+    for (int i = 0; i < num_units; i++) {
+        if (i == 0 || (jfile->restart_interval != 0 && i % jfile->restart_interval == 0)) {
+            _jpeg_start_interval(jfile, i, &bit_reader, prev_DC_coeffs);
+            eob_run = 0;
+        }
+        if (jfile->scan_num_channels == 1) {
+            short* block = plane->data + ((i / units_per_row) * plane->width_in_blocks + i % units_per_row) * 64;
+            if (!_jpeg_decode_progressive_block(jfile, &bit_reader, jfile->scan_channels[0], block, prev_DC_coeffs, &eob_run))
+                return false;
+        }
+        else {
+            int mcu_x = i % nW, mcu_y = i / nW;
+            for (int c = 0; c < jfile->scan_num_channels; c++) {
+                int ch = jfile->scan_channels[c];
+                JPEG_COEFF_PLANE* p = &(coeffs->planes[ch]);
+                for (int b = 0; b < p->hsample * p->vsample; b++) {
+                    int bx = mcu_x * p->hsample + b % p->hsample, by = mcu_y * p->vsample + b / p->hsample;
+                    if (!_jpeg_decode_progressive_block(jfile, &bit_reader, ch, p->data + (by * p->width_in_blocks + bx) * 64,
+                        prev_DC_coeffs, &eob_run))
+                        return false;
+                }
+            }
+        }
+        if (bit_reader.overrun) {
+            _jpeg_dump_message(jfile, "unexpected end of Huffman bitstream.");
+            return false;
+        }
+    }
+    return true;
+}
 
-
-    if (!_jpeg_dequantize_MCUs(jfile, nW, nH, all_MCUs, subsampling_type)) {
-        free(all_MCUs);
-        goto jpeg_read_error;
+/*
+progressive JPEGs: decode the current scan into "coeffs" and read the markers up to the
+header of the next one. "finished" is set after the last scan, or when the data ends
+before the next scan is complete: the scans received make the image.
+*/
+bool _jpeg_progressive_step(JPEG_FILE* jfile, const BYTE* data, int size, JPEG_COEFFICIENTS* coeffs, bool* finished)
+{
+    (*finished) = false;
+    if (!_jpeg_decode_scan(jfile, coeffs))
+        return false;
+    jfile->num_scans++;
+
+    JPEG_STREAM stream;
+    stream.data = data;
+    stream.size = size;
+    stream.pos = jfile->scan_offset + jfile->hstream_size; /* the marker that ends the scan */
+    if (!_jpeg_read_markers(jfile, &stream, false)) {
+        if (stream.pos < stream.size)
+            return false;
+        _jpeg_dump_message(jfile, "incomplete progressive image, decoded from the scans received.");
+        (*finished) = true;
+        return true;
+    }
+    if (jfile->scan_num_channels == 0) { /* EOI */
+        (*finished) = true;
+        return true;
     }
-    if (!_jpeg_IDCT_MCUs(nW, nH, all_MCUs, subsampling_type)) {
-        free(all_MCUs);
-        goto jpeg_read_error;
+    return _jpeg_prepare_huffman_tables(jfile);
+}
+
+/*
+set up the coefficient planes of a progressive image in the scratch memory, the scans
+only fill in part of the coefficients so the planes start cleared. The planes belong
+to the scratch memory, not to "coeffs".
+*/
+bool _jpeg_prepare_coefficient_planes(JPEG_FILE* jfile, int nW, int nH, int subsampling_type,
+    JPEG_COEFFICIENTS* coeffs, JPEG_SCRATCH* scratch)
+{
+    _jpeg_layout_coefficients(jfile, nW, nH, subsampling_type, coeffs);
+    int num_planes = (subsampling_type == 0) ? 1 : 3;
+    long long total = 0;
+    for (int ch = 0; ch < num_planes; ch++)
+        total += 64LL * coeffs->planes[ch].width_in_blocks * coeffs->planes[ch].height_in_blocks;
+    if (total > 0x7FFFFFFF ||
+        !_jpeg_reserve((void**)&(scratch->coeff_planes), &(scratch->coeff_plane_capacity), int(total), sizeof(short))) {
+        _jpeg_dump_message(jfile, "cannot allocate coefficient storage space, maybe the image is too large.");
+        return false;
     }
-    if (!_jpeg_decode_color(jfile, nW, nH, all_MCUs, subsampling_type, &(jfile->image_data))) {
-        free(all_MCUs);
-        goto jpeg_read_error;
+    memset(scratch->coeff_planes, 0, size_t(total) * sizeof(short));
+    short* plane_data = scratch->coeff_planes;
+    for (int ch = 0; ch < num_planes; ch++) {
+        coeffs->planes[ch].data = plane_data;
+        plane_data += 64 * coeffs->planes[ch].width_in_blocks * coeffs->planes[ch].height_in_blocks;
     }
+    return true;
+}
 
-    /* clean up */
-    free(all_MCUs);
+/*
+decode a progressive JPEG: every scan is accumulated into coefficient planes (kept in the
+scratch memory), then the MCUs are read from the planes and output like the ones of a
+baseline image. With a scan callback, the image is output after every scan.
+*/
+bool _jpeg_decode_progressive(JPEG_FILE* jfile, const BYTE* data, int size, int nW, int nH, int subsampling_type,
+    int block_size, JPEG_READ_OPTION* option, JPEG_REGION* roi, JPEG_PIXEL_BUFFER* output, JPEG_SCRATCH* scratch)
+{
+    JPEG_SCRATCH local_scratch; /* released on return when the caller has no scratch memory */
+    if (scratch == NULL)
+        scratch = &local_scratch;
 
-    jfile->is_valid = true;
-    fclose(fp);
+    JPEG_COEFFICIENTS coeffs;
+    if (!_jpeg_prepare_coefficient_planes(jfile, nW, nH, subsampling_type, &coeffs, scratch))
+        return false;
+    int num_planes = (subsampling_type == 0) ? 1 : 3;
+
+    bool success = true, finished = false, output_done = false;
+    while (success && !finished) {
+        success = _jpeg_progressive_step(jfile, data, size, &coeffs, &finished);
+        output_done = false;
+        if (success && option->scan_callback != NULL) {
+            /* preview of the scans decoded so far */
+            success = _jpeg_decode_MCUs(jfile, nW, nH, subsampling_type, block_size, option->num_threads, option->idct_method,
+                option->upsampling, roi, output, &coeffs, scratch);
+            output_done = true;
+            if (success && !option->scan_callback(jfile, jfile->num_scans, option->scan_callback_data))
+                break; /* the preview becomes the image */
+        }
+    }
+    if (success && !output_done) {
+        success = _jpeg_decode_MCUs(jfile, nW, nH, subsampling_type, block_size, option->num_threads, option->idct_method,
+            option->upsampling, roi, output, &coeffs, scratch);
+    }
+    for (int ch = 0; ch < num_planes; ch++)
+        coeffs.planes[ch].data = NULL; /* owned by the scratch memory */
+    return success;
+}
 
-    _jpeg_dump_message(jfile, "JPEG file successfully read.");
-    return jfile;
+/*
+output size and region of interest of an image whose headers have been read: sets
+"output_width" and "output_height", and the size of the decoded blocks "block_size"
+*/
+bool _jpeg_prepare_region(JPEG_FILE* jfile, JPEG_READ_OPTION* option, int* block_size, JPEG_REGION* roi)
+{
+    /* scaled decoding: each 8x8 block becomes a (8/scale_denom) x (8/scale_denom) block */
+    int scale_denom = option->scale_denom;
+    if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8) {
+        _jpeg_dump_message(jfile, "scale_denom can only be 1, 2, 4 or 8.");
+        return false;
+    }
+    (*block_size) = 8 / scale_denom;
+    jfile->output_width = (jfile->image_width + scale_denom - 1) / scale_denom;
+    jfile->output_height = (jfile->image_height + scale_denom - 1) / scale_denom;
+
+    /* region of interest, the decoded image is cropped to it */
+    roi->x = 0; roi->y = 0;
+    roi->width = jfile->output_width;
+    roi->height = jfile->output_height;
+    if (option->roi_width != 0 || option->roi_height != 0) {
+        if (option->roi_x < 0 || option->roi_y < 0 || option->roi_width <= 0 || option->roi_height <= 0 ||
+            option->roi_width > jfile->output_width - option->roi_x ||
+            option->roi_height > jfile->output_height - option->roi_y) {
+            _jpeg_dump_message(jfile, "region of interest is outside the image.");
+            return false;
+        }
+        roi->x = option->roi_x; roi->y = option->roi_y;
+        roi->width = option->roi_width;
+        roi->height = option->roi_height;
+        jfile->output_width = roi->width;
+        jfile->output_height = roi->height;
+    }
+    return true;
+}
+
+/* check the caller-provided buffer (option->output), or allocate "image_data" */
+bool _jpeg_prepare_output(JPEG_FILE* jfile, JPEG_READ_OPTION* option, JPEG_PIXEL_BUFFER* output)
+{
+    if (option->output != NULL) { /* caller-provided buffer */
+        (*output) = *(option->output);
+        int pixel_size = _jpeg_pixel_size(output->format);
+        if (pixel_size == 0) {
+            _jpeg_dump_message(jfile, "unknown output pixel format.");
+            return false;
+        }
+        if (output->data[0] == NULL || (output->format == JPEG_PIXEL_PLANAR_RGB && (output->data[1] == NULL || output->data[2] == NULL))) {
+            _jpeg_dump_message(jfile, "invalid output buffer.");
+            return false;
+        }
+        if (output->width < jfile->output_width || output->height < jfile->output_height ||
+            output->stride < jfile->output_width * pixel_size) {
+            _jpeg_dump_message(jfile, "output buffer is too small for the image.");
+            return false;
+        }
+    }
+    else {
+        /* every pixel is written by the color conversion, no need to clear the image */
+        if (!_jpeg_alloc_image(jfile->output_width, jfile->output_height, &(jfile->image_data), false)) {
+            _jpeg_dump_message(jfile, "cannot allocate image storage space, maybe the image is too large.");
+            return false;
+        }
+        output->format = JPEG_PIXEL_PLANAR_RGB;
+        output->data[0] = jfile->image_data->r;
+        output->data[1] = jfile->image_data->g;
+        output->data[2] = jfile->image_data->b;
+        output->stride = jfile->output_width;
+        output->width = jfile->output_width;
+        output->height = jfile->output_height;
+    }
+    return true;
+}
 
+/* decode a JPEG image held in memory, the decoded image is saved in "jfile" */
+bool _jpeg_decode(JPEG_FILE* jfile, const BYTE* data, int size, JPEG_READ_OPTION* option, JPEG_SCRATCH* scratch)
+{
+    /* read the headers and locate the Huffman bitstream */
+    int subsampling_type, nW, nH;
+    if (!_jpeg_prepare_decode(jfile, data, size, &subsampling_type, &nW, &nH)) {
+        return false;
+    }
+    int block_size;
+    JPEG_REGION roi;
+    JPEG_PIXEL_BUFFER output;
+    if (!_jpeg_prepare_region(jfile, option, &block_size, &roi) || !_jpeg_prepare_output(jfile, option, &output)) {
+        return false;
+    }
+    bool success;
+    if (jfile->is_progressive) {
+        success = _jpeg_decode_progressive(jfile, data, size, nW, nH, subsampling_type, block_size, option, &roi, &output,
+            scratch);
+    }
+    else {
+        success = _jpeg_decode_MCUs(jfile, nW, nH, subsampling_type, block_size, option->num_threads, option->idct_method,
+            option->upsampling, &roi, &output, NULL, scratch);
+    }
+    if (!success) {
+        free_image(jfile->image_data);
+        jfile->image_data = NULL;
+        return false;
+    }
+    return true;
+}
 
-jpeg_read_error:
+/* decode a JPEG image held in memory and set the loading status of "jfile" */
+void _jpeg_read_data(JPEG_FILE* jfile, const BYTE* data, int size, JPEG_READ_OPTION* option, JPEG_SCRATCH* scratch)
+{
+    JPEG_READ_OPTION default_option;
+    if (option == NULL)
+        option = &default_option;
+    jfile->is_valid = _jpeg_decode(jfile, data, size, option, scratch);
+
+    /* the Huffman bitstream points into the input data, which can be */
+    /* released by the caller as soon as we return */
+    jfile->hstream = NULL;
+    jfile->hstream_size = 0;
+
+    if (jfile->is_valid)
+        _jpeg_dump_message(jfile, "JPEG file successfully read.");
+    else
+        _jpeg_dump_message(jfile, "error when loading JPEG image file.");
+}
 
+/* copy the coefficients of a block to "out" (64 coefficients in natural order) */
+void _jpeg_store_coeffs(const INT_8x8* block, short* out) {
+    const int* in = &(block->data[0][0]);
+    for (int k = 0; k < 64; k++)
+        out[k] = short(in[k]);
+}
 
-    jfile->is_valid = false;
-    fclose(fp);
-    _jpeg_dump_message(jfile, "error when loading JPEG image file.");
-    return jfile;
+/* copy the 64 coefficients at "in" (natural order) to a block */
+void _jpeg_load_coeffs(const short* in, INT_8x8* block) {
+    int* out = &(block->data[0][0]);
+    for (int k = 0; k < 64; k++)
+        out[k] = int(in[k]);
 }
+
 /*
-jpeg_free: unload a JPEG file, free all resources allocated.
+entropy decode every MCU into the coefficient planes of "coeffs" (see
+_jpeg_layout_coefficients), nothing else is done: no dequantization, no IDCT, no color
+conversion. The scans of progressive images are merged into the planes.
 */
-JPEG_API void jpeg_free(JPEG_FILE * jfile)
+bool _jpeg_decode_coefficients(JPEG_FILE* jfile, const BYTE* data, int size, int nW, int nH, int subsampling_type,
+    JPEG_COEFFICIENTS* coeffs)
 {
-    free_image(jfile->image_data);
-    delete jfile;
+    int hfactor = (subsampling_type == 2 || subsampling_type == 4) ? 2 : 1;
+    int vfactor = (subsampling_type == 3 || subsampling_type == 4) ? 2 : 1;
+    int num_planes = (subsampling_type == 0) ? 1 : 3;
+    _jpeg_layout_coefficients(jfile, nW, nH, subsampling_type, coeffs);
+    for (int ch = 0; ch < num_planes; ch++) {
+        JPEG_COEFF_PLANE* plane = &(coeffs->planes[ch]);
+        size_t count = size_t(64) * plane->width_in_blocks * plane->height_in_blocks;
+        /* the scans of a progressive image only fill in part of the coefficients */
+        plane->data = (short*)(jfile->is_progressive ? calloc(count, sizeof(short)) : malloc(count * sizeof(short)));
+        if (plane->data == NULL) {
+            _jpeg_dump_message(jfile, "cannot allocate coefficient storage space, maybe the image is too large.");
+            return false;
+        }
+    }
+    if (jfile->is_progressive) {
+        bool finished = false;
+        while (!finished) {
+            if (!_jpeg_progressive_step(jfile, data, size, coeffs, &finished))
+                return false;
+        }
+        return true;
+    }
+
+    if (jfile->restart_interval != 0 &&
+        jfile->rst_offsets.size() < (nW * nH + jfile->restart_interval - 1) / jfile->restart_interval - 1) {
+        _jpeg_dump_message(jfile, "missing restart marker.");
+        return false;
+    }
+    JPEG_BIT_READER bit_reader;
+    int prev_DC_coeffs[4] = { 0 };
+    JPEG_MCU_COEFF MCU;
+    INT_8x8* Y_blocks[4] = { &(MCU.Y0), &(MCU.Y1), &(MCU.Y2), &(MCU.Y3) };
+    int Y_stride = coeffs->planes[0].width_in_blocks * 64, C_stride = nW * 64;
+    for (int i = 0; i < nW * nH; i++) { /* for each MCU in raster scan order */
+        if (i == 0 || (jfile->restart_interval != 0 && i % jfile->restart_interval == 0))
+            _jpeg_start_interval(jfile, i, &bit_reader, prev_DC_coeffs);
+        if (!_jpeg_decode_MCU(jfile, jfile->message, &bit_reader, prev_DC_coeffs, &MCU, subsampling_type, false))
+            return false;
+        int mcu_x = i % nW, mcu_y = i / nW;
+        short* Y = coeffs->planes[0].data + mcu_y * vfactor * Y_stride + mcu_x * hfactor * 64;
+        for (int b = 0; b < hfactor * vfactor; b++)
+            _jpeg_store_coeffs(Y_blocks[b], Y + (b / hfactor) * Y_stride + (b % hfactor) * 64);
+        if (num_planes == 3) {
+            _jpeg_store_coeffs(&(MCU.Cb), coeffs->planes[1].data + mcu_y * C_stride + mcu_x * 64);
+            _jpeg_store_coeffs(&(MCU.Cr), coeffs->planes[2].data + mcu_y * C_stride + mcu_x * 64);
+        }
+    }
+    return true;
 }
-/*
-jpeg_save: save an image data as JPEG format.
 
-* example:
+/* read the quantized coefficients of a JPEG image held in memory */
+void _jpeg_read_coefficients_data(JPEG_COEFFICIENTS* coeffs, const BYTE* data, int size)
+{
+    JPEG_FILE* jfile = new JPEG_FILE();
+    if (jfile == NULL) {
+        _jpeg_append_message(coeffs->message, "out of memory.");
+        return;
+    }
+    int subsampling_type, nW, nH;
+    coeffs->is_valid = _jpeg_prepare_decode(jfile, data, size, &subsampling_type, &nW, &nH) &&
+        _jpeg_decode_coefficients(jfile, data, size, nW, nH, subsampling_type, coeffs);
+    if (coeffs->is_valid)
+        _jpeg_dump_message(jfile, "JPEG coefficients successfully read.");
+    else
+        _jpeg_dump_message(jfile, "error when loading JPEG image file.");
+    _jpeg_append_message(coeffs->message, jfile->message);
+    delete jfile;
+}
 
-    JPEG_SAVE_OPTION option;
-    option.save_preset = JPEG_SAVE_PRESET_MEDIUM;  <= using medium quality preset
-    jpeg_save(image, &option, "example.jpg");      <= saving image as "example.jpg"
+/* append the APPn and COM markers found before the first SOS marker of a JPEG file */
+/* (EXIF, ICC profile, comments, ...) */
+void _jpeg_copy_app_markers(const BYTE* data, int size, Bitstream* jpeg)
+{
+    if (size < 4 || data[0] != 0xFF || data[1] != SOI)
+        return;
+    int pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF)
+            return; /* corrupted, stop here */
+        BYTE marker = data[pos + 1];
+        if (marker == 0xFF) { /* fill byte */
+            pos++;
+            continue;
+        }
+        if (marker == SOS || marker == EOI)
+            return;
+        int length = (int(data[pos + 2]) << 8) | int(data[pos + 3]);
+        if (length < 2 || pos + 2 + length > size)
+            return;
+        if ((marker >= APP0 && marker <= APP15) || marker == COM) {
+            for (int i = 0; i < 2 + length; i++)
+                jpeg->appendBits(data[pos + i], 8);
+        }
+        pos += 2 + length;
+    }
+}
+
+/*
+entropy encode the coefficients of "coeffs" as a baseline JPEG file, with the quantization
+tables of the planes and optimal Huffman tables (one DC/AC pair for the luminance, one for
+the chrominance). Nothing is quantized or transformed, the image is exactly the one the
+coefficients hold. The APPn and COM markers of the JPEG file "src" are copied (NULL: none).
+*/
+bool _jpeg_write_coefficients(JPEG_COEFFICIENTS* coeffs, const BYTE* src, int src_size, Bitstream* jpeg)
+{
+    /* the layouts read by _jpeg_decode_coefficients() */
+    int subsampling_type = -1;
+    int hfactor = coeffs->max_hsample, vfactor = coeffs->max_vsample;
+    if (coeffs->num_channels == 1 && hfactor == 1 && vfactor == 1)
+        subsampling_type = 0;
+    else if (coeffs->num_channels == 3 && hfactor >= 1 && hfactor <= 2 && vfactor >= 1 && vfactor <= 2)
+        subsampling_type = (hfactor == 1) ? (vfactor == 1 ? 1 : 3) : (vfactor == 1 ? 2 : 4);
+    int nW = coeffs->MCUs_per_row, nH = coeffs->MCU_rows;
+    bool is_valid = (subsampling_type >= 0 &&
+        coeffs->image_width > 0 && coeffs->image_width <= 65535 &&
+        coeffs->image_height > 0 && coeffs->image_height <= 65535 &&
+        nW == (coeffs->image_width + 8 * hfactor - 1) / (8 * hfactor) &&
+        nH == (coeffs->image_height + 8 * vfactor - 1) / (8 * vfactor) &&
+        coeffs->restart_interval >= 0 && coeffs->restart_interval <= 65535);
+    for (int ch = 0; is_valid && ch < coeffs->num_channels; ch++) {
+        JPEG_COEFF_PLANE* plane = &(coeffs->planes[ch]);
+        is_valid = (plane->data != NULL &&
+            plane->hsample == (ch == 0 ? hfactor : 1) && plane->vsample == (ch == 0 ? vfactor : 1) &&
+            plane->width_in_blocks == nW * plane->hsample && plane->height_in_blocks == nH * plane->vsample &&
+            plane->qtab_id >= 0 && plane->qtab_id < 4 &&
+            (coeffs->qtab_bits[plane->qtab_id] == 8 || coeffs->qtab_bits[plane->qtab_id] == 16));
+    }
+    if (!is_valid) {
+        _jpeg_append_message(coeffs->message, "invalid coefficient layout.");
+        return false;
+    }
+
+    /* gather the blocks of each MCU */
+    FixedArray2D<JPEG_MCU_QCOEFF> qCoeffs;
+    qCoeffs.create(nW, nH);
+    for (int mcu_y = 0; mcu_y < nH; mcu_y++) {
+        for (int mcu_x = 0; mcu_x < nW; mcu_x++) {
+            INT_8x8* blocks[6]; int* diffs[6]; int components[6];
+            int n = _jpeg_QCOEFF_blocks(&(qCoeffs.at(mcu_x, mcu_y)), subsampling_type, blocks, diffs, components);
+            for (int b = 0, Y_block = 0; b < n; b++) {
+                JPEG_COEFF_PLANE* plane = &(coeffs->planes[components[b]]);
+                int bx = mcu_x * plane->hsample, by = mcu_y * plane->vsample;
+                if (components[b] == 0) { /* see _jpeg_decode_coefficients() */
+                    bx += Y_block % hfactor;
+                    by += Y_block / hfactor;
+                    Y_block++;
+                }
+                _jpeg_load_coeffs(plane->data + (by * plane->width_in_blocks + bx) * 64, blocks[b]);
+            }
+        }
+    }
+    _jpeg_differentiate_DC(&qCoeffs, subsampling_type, coeffs->restart_interval);
+
+    /* write image start marker */
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(SOI, 8);
+    if (src != NULL)
+        _jpeg_copy_app_markers(src, src_size, jpeg);
+
+    /* write the quantization tables of the planes */
+    bool qtab_is_used[4] = { false, false, false, false };
+    for (int ch = 0; ch < coeffs->num_channels; ch++)
+        qtab_is_used[coeffs->planes[ch].qtab_id] = true;
+    int length = 2;
+    for (int t = 0; t < 4; t++) {
+        if (qtab_is_used[t])
+            length += 1 + 64 * (coeffs->qtab_bits[t] / 8);
+    }
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(DQT, 8);
+    jpeg->appendBits(length, 16);
+    for (int t = 0; t < 4; t++) {
+        if (!qtab_is_used[t])
+            continue;
+        jpeg->appendBits(coeffs->qtab_bits[t] == 16 ? 1 : 0, 4); /* precision */
+        jpeg->appendBits(t, 4); /* qtab id */
+        int qtab_coeffs[64];
+        _jpeg_zz_int8x8_to_intarr(&(coeffs->qtabs[t]), qtab_coeffs);
+        for (int i = 0; i < 64; i++)
+            jpeg->appendBits(qtab_coeffs[i], coeffs->qtab_bits[t]);
+    }
+
+    /* define restart interval */
+    if (coeffs->restart_interval != 0) {
+        jpeg->appendBits(0xFF, 8); jpeg->appendBits(DRI, 8);
+        jpeg->appendBits(0x0004, 16);
+        jpeg->appendBits(coeffs->restart_interval, 16);
+    }
+
+    /* define start of frame */
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(SOF0, 8);
+    jpeg->appendBits(8 + 3 * coeffs->num_channels, 16);
+    jpeg->appendBits(8, 8);
+    jpeg->appendBits(coeffs->image_height, 16);
+    jpeg->appendBits(coeffs->image_width, 16);
+    jpeg->appendBits(coeffs->num_channels, 8);
+    for (int ch = 0; ch < coeffs->num_channels; ch++) {
+        jpeg->appendBits(ch + 1, 8); /* channel ID */
+        jpeg->appendBits(coeffs->planes[ch].hsample, 4); /* sampling factors (h/v) */
+        jpeg->appendBits(coeffs->planes[ch].vsample, 4);
+        jpeg->appendBits(coeffs->planes[ch].qtab_id, 8); /* quantization table ID */
+    }
+
+    /* define Huffman tables, table 0 for the luminance and 1 for the chrominance */
+    static const int component_tables[3] = { 0, 1, 1 };
+    static const int component_masks[2] = { 0x01, 0x06 };
+    int num_tables = (coeffs->num_channels == 1) ? 1 : 2;
+    Array<BYTE>      DC_symbols[2], AC_symbols[2];
+    Array<Bitstream> DC_codes[2], AC_codes[2];
+    Array<int>       DC_bins[2], AC_bins[2];
+    for (int t = 0; t < num_tables; t++) {
+        _jpeg_generate_huffman_tables(&qCoeffs, subsampling_type, component_masks[t],
+            &DC_symbols[t], &DC_codes[t], &DC_bins[t],
+            &AC_symbols[t], &AC_codes[t], &AC_bins[t]);
+        _jpeg_write_huffman_tables(jpeg, t, &DC_symbols[t], &DC_bins[t], &AC_symbols[t], &AC_bins[t]);
+    }
+
+    /* define start of scan */
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(SOS, 8);
+    jpeg->appendBits(6 + 2 * coeffs->num_channels, 16);
+    jpeg->appendBits(coeffs->num_channels, 8);
+    for (int ch = 0; ch < coeffs->num_channels; ch++) {
+        jpeg->appendBits(ch + 1, 8); /* channel ID */
+        jpeg->appendBits(component_tables[ch], 4); /* DC huffman table ID */
+        jpeg->appendBits(component_tables[ch], 4); /* AC huffman table ID */
+    }
+    jpeg->appendBits(0, 8);  /* start of selection */
+    jpeg->appendBits(63, 8); /* end of selection */
+    jpeg->appendBits(0, 8);  /* successive approximation (H/L) */
+    /* write huffman bitstream */
+    Bitstream bs;
+    _jpeg_generate_huffman_bitstream(&qCoeffs, subsampling_type,
+        DC_symbols, DC_codes, AC_symbols, AC_codes, component_tables, coeffs->restart_interval, &bs);
+    jpeg->appendBitstream(bs, bs.size());
+    jpeg->alignWrite();
+
+    /* end of image (EOI) marker */
+    jpeg->appendBits(0xFF, 8); jpeg->appendBits(EOI, 8);
+    return true;
+}
+
+/* transform a block of coefficients: c'[u][v] = c[v][u] when transposing, then the odd */
+/* horizontal (vertical) frequencies change sign when flipping horizontally (vertically) */
+void _jpeg_transform_block(const short* in, short* out, bool transpose, bool flip_h, bool flip_v) {
+    for (int u = 0; u < 8; u++) {
+        for (int v = 0; v < 8; v++) {
+            short c = transpose ? in[v * 8 + u] : in[u * 8 + v];
+            if ((flip_h && (v & 1)) != (flip_v && (u & 1)))
+                c = -c;
+            out[u * 8 + v] = c;
+        }
+    }
+}
+
+/* load the whole file with a single read, false if it cannot be opened */
+/* (an empty or unreadable file leaves "data" empty) */
+bool _jpeg_load_file(const char* file, Array<BYTE>* data)
+{
+    FILE* fp = NULL;
+    if ((fp = fopen(file, "rb")) == NULL) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size <= 0 || size > 0x7FFFFFFF || !data->resize(int(size)) ||
+        !_jpeg_read_fp(fp, int(size), data->data())) {
+        data->resize(0); /* reported as an invalid JPEG file */
+    }
+    fclose(fp);
+    return true;
+}
+
+/* read-only memory mapping of a whole file */
+struct JPEG_MAPPED_FILE {
+    const BYTE* data; /* mapped file content (NULL for empty files) */
+    int size;         /* file size in bytes */
+#if defined(_MSC_VER)
+    HANDLE file_handle;
+    HANDLE mapping_handle;
+#else
+    int fd;
+#endif
+};
+
+bool _jpeg_map_file(const char* file, JPEG_MAPPED_FILE* mfile)
+{
+    mfile->data = NULL;
+    mfile->size = 0;
+#if defined(_MSC_VER)
+    mfile->mapping_handle = NULL;
+    mfile->file_handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mfile->file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(mfile->file_handle, &file_size) || file_size.QuadPart > 0x7FFFFFFF) {
+        CloseHandle(mfile->file_handle);
+        return false;
+    }
+    mfile->size = int(file_size.QuadPart);
+    if (mfile->size == 0) {
+        return true; /* empty files cannot be mapped */
+    }
+    mfile->mapping_handle = CreateFileMappingA(mfile->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mfile->mapping_handle != NULL) {
+        mfile->data = (const BYTE*)MapViewOfFile(mfile->mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (mfile->data == NULL) {
+        if (mfile->mapping_handle != NULL)
+            CloseHandle(mfile->mapping_handle);
+        CloseHandle(mfile->file_handle);
+        return false;
+    }
+#else
+    mfile->fd = open(file, O_RDONLY);
+    if (mfile->fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(mfile->fd, &file_stat) != 0 || file_stat.st_size > 0x7FFFFFFF) {
+        close(mfile->fd);
+        return false;
+    }
+    mfile->size = int(file_stat.st_size);
+    if (mfile->size == 0) {
+        return true; /* empty files cannot be mapped */
+    }
+    void* addr = mmap(NULL, mfile->size, PROT_READ, MAP_PRIVATE, mfile->fd, 0);
+    if (addr == MAP_FAILED) {
+        close(mfile->fd);
+        return false;
+    }
+    mfile->data = (const BYTE*)addr;
+#endif
+    return true;
+}
+
+void _jpeg_unmap_file(JPEG_MAPPED_FILE* mfile)
+{
+#if defined(_MSC_VER)
+    if (mfile->data != NULL) {
+        UnmapViewOfFile(mfile->data);
+        CloseHandle(mfile->mapping_handle);
+    }
+    CloseHandle(mfile->file_handle);
+#else
+    if (mfile->data != NULL)
+        munmap((void*)mfile->data, mfile->size);
+    close(mfile->fd);
+#endif
+    mfile->data = NULL;
+    mfile->size = 0;
+}
+
+/* read the headers of a JPEG image held in memory and fill "info", the bitstream is not touched */
+bool _jpeg_probe_data(const BYTE* data, int size, JPEG_INFO* info)
+{
+    memset(info, 0, sizeof(JPEG_INFO));
+    JPEG_FILE* jfile = new JPEG_FILE();
+    if (jfile == NULL) {
+        _jpeg_append_message(info->message, "out of memory.");
+        return false;
+    }
+    JPEG_STREAM stream;
+    stream.data = data;
+    stream.size = size;
+    stream.pos = 0;
+    info->is_valid = _jpeg_read_file(jfile, &stream, true);
+    if (info->is_valid && jfile->image_width == 0) {
+        _jpeg_dump_message(jfile, "missing SOF0 marker.");
+        info->is_valid = false;
+    }
+    if (info->is_valid) {
+        info->image_width = jfile->image_width;
+        info->image_height = jfile->image_height;
+        info->num_channels = jfile->num_channels;
+        info->is_progressive = jfile->is_progressive;
+        info->restart_interval = jfile->restart_interval;
+        info->scan_offset = jfile->scan_offset;
+        for (int i = 0; i < 4; i++) {
+            info->channels[i] = jfile->channels[i];
+            info->qtab_bits[i] = jfile->qtab_bits[i];
+            info->dctab_symbols[i] = jfile->dctabs[i].is_used ? jfile->dctabs[i].offsets[16] : 0;
+            info->actab_symbols[i] = jfile->actabs[i].is_used ? jfile->actabs[i].offsets[16] : 0;
+        }
+    }
+    else {
+        _jpeg_append_message(info->message, jfile->message);
+    }
+    delete jfile;
+    return info->is_valid;
+}
+
+/*
+long-lived decoding context (jpeg_create_decoder), the JPEG_FILE and the scratch
+memory are reused by every image.
+*/
+struct JPEG_DECODER {
+    JPEG_READ_OPTION option; /* options given at creation, "output" is set by each call */
+    JPEG_FILE jfile;         /* headers and message of the last image */
+    JPEG_SCRATCH scratch;
+};
+
+/*
+a thread of jpeg_read_batch(): takes the next image of the batch until all are
+decoded. Each image is decoded by this thread alone, with the worker's scratch
+memory, so that nothing is allocated once the buffers fit the images.
+*/
+struct JPEG_BATCH_WORKER {
+    JPEG_BATCH_INPUT* inputs;
+    int count;
+    std::atomic<int>* next_input;  /* index of the next image to decode (shared) */
+    JPEG_READ_OPTION option;       /* options of the batch, single-threaded decoding */
+    JPEG_FILE** results;           /* completion array (may be NULL) */
+    JPEG_BATCH_CALLBACK callback;  /* (may be NULL) */
+    void* user_data;
+    JPEG_FILE* jfile;              /* reused for every image when there is no completion array */
+    JPEG_SCRATCH scratch;
+    bool success;                  /* every image taken by this worker is valid */
+};
+
+void _jpeg_batch_worker(JPEG_BATCH_WORKER* worker) {
+    worker->success = true;
+    while (true) {
+        int i = (*(worker->next_input))++;
+        if (i >= worker->count)
+            break;
+        JPEG_BATCH_INPUT* input = &(worker->inputs[i]);
+        JPEG_FILE* jfile = worker->jfile;
+        if (worker->results != NULL) {
+            jfile = new JPEG_FILE();
+            worker->results[i] = jfile;
+            if (jfile == NULL) { /* memory is full */
+                worker->success = false;
+                continue;
+            }
+        }
+        worker->option.output = input->output;
+        if (input->file != NULL) {
+            bool opened = _jpeg_load_file(input->file, &(worker->scratch.file_data));
+            if (!opened)
+                worker->scratch.file_data.resize(0);
+            _jpeg_read_data(jfile, worker->scratch.file_data.data(), worker->scratch.file_data.size(),
+                &(worker->option), &(worker->scratch));
+            if (!opened) {
+                memset(jfile->message, 0, _JPEG_MSG_LEN);
+                _jpeg_dump_message(jfile, "cannot open file.");
+            }
+        }
+        else {
+            _jpeg_read_data(jfile, (const BYTE*)input->data, input->data != NULL ? input->size : 0,
+                &(worker->option), &(worker->scratch));
+        }
+        if (!jfile->is_valid)
+            worker->success = false;
+        if (worker->callback != NULL)
+            worker->callback(i, jfile, worker->user_data);
+        if (worker->results == NULL) { /* unless the callback took it */
+            free_image(jfile->image_data);
+            jfile->image_data = NULL;
+        }
+    }
+}
+
+/* states of a stream decoder */
+#define _JPEG_STREAM_HEADERS 0 /* reading the markers up to the first scan */
+#define _JPEG_STREAM_START   1 /* headers read, the output is set up by the next step */
+#define _JPEG_STREAM_MCUS    2 /* baseline: decoding the MCUs */
+#define _JPEG_STREAM_SCAN    3 /* progressive: waiting for the end of a scan */
+#define _JPEG_STREAM_MARKERS 4 /* progressive: reading the markers between scans */
+#define _JPEG_STREAM_DONE    5
+#define _JPEG_STREAM_ERROR   6
+
+/* the bytes already decoded are dropped once there are this many of them */
+#define _JPEG_STREAM_COMPACT_SIZE 65536
+/* an MCU cut by the end of the data is decoded again once the data for about this */
+/* many more MCUs is received, so that decoding it twice costs little */
+#define _JPEG_STREAM_RETRY_MCUS 4
+
+/*
+push-based decoding context (jpeg_create_stream_decoder). The data fed so far is
+kept in "buffer" and every call of jpeg_stream_step() resumes where the previous
+one stopped. Baseline images are entropy decoded MCU by MCU by a single worker, the
+bit reader and the DC predictions are kept between calls, and an MCU that runs out
+of data is decoded again once enough data is fed (see _JPEG_STREAM_RETRY_MCUS) or
+the marker that ends its interval is received. The scans of progressive images
+are decoded into coefficient planes one after the other.
+All offsets are offsets in "buffer", they move when decoded bytes are dropped.
+*/
+struct JPEG_STREAM_DECODER {
+    JPEG_READ_OPTION option;
+    JPEG_FILE jfile;
+    JPEG_SCRATCH scratch;
+    int state;
+
+    BYTE* buffer;                /* data fed and not dropped yet */
+    int size, capacity;
+    int markers_pos;             /* start of the markers to read */
+    int walk_pos;                /* end of the complete marker segments after "markers_pos" */
+
+    int subsampling_type, nW, nH, block_size;
+    JPEG_REGION roi;
+    JPEG_PIXEL_BUFFER output;
+    int rows;                    /* complete rows of the output */
+
+    int scan_origin;             /* start of the entropy-coded segment (negative once dropped) */
+    int scan_pos;                /* where scanning the segment resumes */
+    int segment_end;             /* size of the segment, -1 until its marker is received */
+
+    /* baseline images */
+    JPEG_MCU_WORKER* worker;     /* in the scratch memory */
+    int mcu;                     /* next MCU to decode */
+    int interval_mcu;            /* first MCU of the restart interval being decoded (-1: none) */
+    int interval_pos;            /* start of the data of that interval */
+    int wanted_size;             /* the MCU cut by the end of the data waits for this many bytes */
+    JPEG_BIT_READER bit_reader;  /* reads "buffer" directly */
+    int prev_DC_coeffs[4];
+
+    /* progressive images */
+    JPEG_COEFFICIENTS coeffs;    /* planes in the scratch memory */
+    bool rendered;               /* the coefficients have been output since the last scan */
+};
+
+/*
+do the bytes from "*pos" hold complete marker segments up to a SOS header or an EOI
+marker? "*pos" moves past the complete segments so that the next call resumes there.
+Invalid data is left to _jpeg_read_markers() which reports it.
+*/
+bool _jpeg_stream_markers_ready(const BYTE* data, int size, int* pos) {
+    while (true) {
+        int i = (*pos);
+        if (i + 2 > size)
+            return false;
+        if (data[i] != 0xFF)
+            return true;
+        BYTE marker = data[i + 1];
+        if (marker == 0xFF) { /* fill bytes */
+            (*pos) = i + 1;
+            continue;
+        }
+        if (marker == EOI)
+            return true;
+        if (i + 4 > size)
+            return false;
+        int length = (int(data[i + 2]) << 8) | int(data[i + 3]);
+        if (length < 2)
+            return true;
+        if (length > size - i - 2)
+            return false;
+        if (marker == SOS)
+            return true;
+        (*pos) = i + 2 + length;
+    }
+}
+
+/* drop the first "n" bytes of the buffer */
+void _jpeg_stream_discard(JPEG_STREAM_DECODER* decoder, int n) {
+    memmove(decoder->buffer, decoder->buffer + n, decoder->size - n);
+    decoder->size -= n;
+    decoder->markers_pos -= n;
+    decoder->walk_pos -= n;
+    decoder->scan_origin -= n;
+    decoder->scan_pos -= n;
+    decoder->bit_reader.pos -= n;
+    decoder->bit_reader.size -= n;
+    decoder->interval_pos -= n;
+    decoder->wanted_size -= n;
+}
+
+/*
+scan the part of the entropy-coded segment received since the last call, returns true
+once the marker that ends it is found. The offsets of the restart markers are saved
+relative to the start of the segment, as _jpeg_read_SOS() does.
+*/
+bool _jpeg_stream_scan_segment(JPEG_STREAM_DECODER* decoder) {
+    if (decoder->segment_end >= 0)
+        return true;
+    Array<int>* rst_offsets = &(decoder->jfile.rst_offsets);
+    int first = rst_offsets->size();
+    int end = _jpeg_scan_entropy_segment(decoder->buffer, decoder->size, &(decoder->scan_pos), rst_offsets);
+    for (int k = first; k < rst_offsets->size(); k++)
+        (*rst_offsets)[k] -= decoder->scan_origin;
+    if (end < 0)
+        return false;
+    decoder->segment_end = end - decoder->scan_origin;
+    return true;
+}
+
+/* output the image decoded from the coefficient planes (progressive images) */
+bool _jpeg_stream_render(JPEG_STREAM_DECODER* decoder) {
+    JPEG_READ_OPTION* option = &(decoder->option);
+    decoder->rendered = true;
+    return _jpeg_decode_MCUs(&(decoder->jfile), decoder->nW, decoder->nH, decoder->subsampling_type,
+        decoder->block_size, option->num_threads, option->idct_method, option->upsampling, &(decoder->roi),
+        &(decoder->output), &(decoder->coeffs), &(decoder->scratch));
+}
+
+/* set the final status of a stream decoder, as _jpeg_read_data() does */
+int _jpeg_stream_finish(JPEG_STREAM_DECODER* decoder, bool success) {
+    JPEG_FILE* jfile = &(decoder->jfile);
+    jfile->hstream = NULL; /* points into the buffer */
+    jfile->hstream_size = 0;
+    jfile->is_valid = success;
+    if (success) {
+        decoder->rows = decoder->roi.height;
+        decoder->state = _JPEG_STREAM_DONE;
+        _jpeg_dump_message(jfile, "JPEG file successfully read.");
+        return JPEG_STREAM_DONE;
+    }
+    free_image(jfile->image_data);
+    jfile->image_data = NULL;
+    decoder->state = _JPEG_STREAM_ERROR;
+    _jpeg_dump_message(jfile, "error when loading JPEG image file.");
+    return JPEG_STREAM_ERROR;
+}
+
+/*
+decode the MCUs of a baseline image as far as the data received allows, returns
+JPEG_STREAM_ROWS as soon as a row of MCUs is output
+*/
+int _jpeg_stream_decode_MCUs(JPEG_STREAM_DECODER* decoder) {
+    JPEG_FILE* jfile = &(decoder->jfile);
+    JPEG_MCU_WORKER* worker = decoder->worker;
+    JPEG_BIT_READER* bit_reader = &(decoder->bit_reader);
+    bit_reader->data = decoder->buffer; /* the buffer may have been reallocated */
+
+    /* the bytes before the bit reader are not needed anymore */
+    if (decoder->interval_mcu >= 0) {
+        int n = (bit_reader->pos < decoder->scan_pos) ? bit_reader->pos : decoder->scan_pos;
+        if (n >= _JPEG_STREAM_COMPACT_SIZE && n >= decoder->size / 2)
+            _jpeg_stream_discard(decoder, n);
+    }
+    bool end_found = _jpeg_stream_scan_segment(decoder);
+    Array<int>* rst_offsets = &(jfile->rst_offsets);
+    int restart_interval = jfile->restart_interval;
+    int nW = decoder->nW;
+    int MCU_width, MCU_height;
+    _jpeg_MCU_size(decoder->subsampling_type, decoder->block_size, &MCU_width, &MCU_height);
+
+    while (decoder->mcu < worker->decode_last) {
+        int i = decoder->mcu;
+        int interval = (restart_interval != 0) ? i / restart_interval : 0;
+        if (decoder->interval_mcu < 0 ||
+            (restart_interval != 0 && i % restart_interval == 0 && decoder->interval_mcu != i)) {
+            /* the interval starts after its RST marker, the DC predictions are reset */
+            int start = decoder->scan_origin;
+            if (interval > 0) {
+                if (rst_offsets->size() < interval) {
+                    if (!end_found)
+                        return JPEG_STREAM_NEED_DATA;
+                    _jpeg_dump_message(jfile, "missing restart marker.");
+                    return JPEG_STREAM_ERROR;
+                }
+                start += (*rst_offsets)[interval - 1] + 2;
+            }
+            _jpeg_bit_reader_init(bit_reader, decoder->buffer, start);
+            bit_reader->pos = start;
+            for (int c = 0; c < 4; c++)
+                decoder->prev_DC_coeffs[c] = 0;
+            decoder->interval_mcu = i;
+            decoder->interval_pos = start;
+        }
+        /* the interval ends at the next marker, or for now where the data received ends */
+        int end = decoder->size;
+        bool end_known = true;
+        if (interval < rst_offsets->size())
+            end = decoder->scan_origin + (*rst_offsets)[interval];
+        else if (end_found)
+            end = decoder->scan_origin + decoder->segment_end;
+        else
+            end_known = false;
+        if (!end_known && decoder->size < decoder->wanted_size)
+            return JPEG_STREAM_NEED_DATA; /* not worth decoding the MCU again yet */
+        if (bit_reader->size != end) {
+            /* the padding bits stand for bytes that have been received since */
+            bit_reader->bits -= bit_reader->padding;
+            bit_reader->padding = 0;
+            bit_reader->marker = 0;
+            bit_reader->size = end;
+        }
+
+        /* an MCU cut by the end of the data is decoded again from the same state */
+        JPEG_BIT_READER saved_reader = (*bit_reader);
+        int saved_DC_coeffs[4];
+        memcpy(saved_DC_coeffs, decoder->prev_DC_coeffs, sizeof(saved_DC_coeffs));
+        char message[_JPEG_MSG_LEN];
+        message[0] = '\0';
+        if (!_jpeg_decode_MCU(jfile, message, bit_reader, decoder->prev_DC_coeffs, &(worker->coeff_row[i % nW]),
+            decoder->subsampling_type, worker->luma_only)) {
+            if (!end_known) {
+                /* wait for at least the bytes it read as padding, and for the data of */
+                /* _JPEG_STREAM_RETRY_MCUS MCUs as large as the previous ones on average */
+                int overrun_bits = bit_reader->padded - saved_reader.padded + saved_reader.padding - bit_reader->padding;
+                int missing = (overrun_bits + 7) / 8;
+                int decoded = i - decoder->interval_mcu;
+                if (decoded > 0) {
+                    int MCU_pos = saved_reader.pos - (saved_reader.bits - saved_reader.padding) / 8;
+                    int average = (MCU_pos - decoder->interval_pos) / decoded;
+                    if (missing < _JPEG_STREAM_RETRY_MCUS * average)
+                        missing = _JPEG_STREAM_RETRY_MCUS * average;
+                }
+                decoder->wanted_size = decoder->size + ((missing > 1) ? missing : 1);
+                (*bit_reader) = saved_reader;
+                memcpy(decoder->prev_DC_coeffs, saved_DC_coeffs, sizeof(saved_DC_coeffs));
+                return JPEG_STREAM_NEED_DATA;
+            }
+            _jpeg_dump_message(jfile, message);
+            return JPEG_STREAM_ERROR;
+        }
+        decoder->mcu++;
+        decoder->wanted_size = 0;
+        _jpeg_worker_MCU_done(worker, i);
+        if (worker->row_start == decoder->mcu && decoder->mcu % nW == 0) {
+            /* with fancy upsampling, the last line of the row waits for the next row */
+            int rows = (decoder->mcu / nW) * MCU_height - (worker->pending ? 1 : 0) - decoder->roi.y;
+            if (rows > decoder->roi.height)
+                rows = decoder->roi.height;
+            if (rows > decoder->rows) {
+                decoder->rows = rows;
+                return JPEG_STREAM_ROWS;
+            }
+        }
+    }
+
+    /* every MCU of the region is output, the image ends with the EOI marker */
+    _jpeg_worker_finish(worker);
+    if (decoder->rows < decoder->roi.height) {
+        decoder->rows = decoder->roi.height;
+        return JPEG_STREAM_ROWS;
+    }
+    if (!end_found)
+        return JPEG_STREAM_NEED_DATA;
+    BYTE marker = decoder->buffer[decoder->scan_origin + decoder->segment_end + 1];
+    if (marker != EOI) {
+        char buf[128];
+        sprintf(buf, "invalid JPEG marker : '0xFF%02X'.\n", marker);
+        _jpeg_dump_message(jfile, buf);
+        return JPEG_STREAM_ERROR;
+    }
+    return JPEG_STREAM_DONE;
+}
+
+/* go on decoding with the data received, see jpeg_stream_step() */
+int _jpeg_stream_step(JPEG_STREAM_DECODER* decoder) {
+    JPEG_FILE* jfile = &(decoder->jfile);
+    JPEG_READ_OPTION* option = &(decoder->option);
+    while (true) {
+        if (decoder->state == _JPEG_STREAM_HEADERS) {
+            /* the markers are parsed once they are all received: a short feed only moves walk_pos,
+               so the parse (and its trace in debug builds) is never repeated */
+            if (decoder->size < 2 || !_jpeg_stream_markers_ready(decoder->buffer, decoder->size, &(decoder->walk_pos)))
+                return JPEG_STREAM_NEED_DATA;
+            JPEG_STREAM stream;
+            stream.data = decoder->buffer;
+            stream.size = decoder->size;
+            stream.pos = 0;
+            if (!_jpeg_read_file(jfile, &stream, true) ||
+                !_jpeg_prepare_frame(jfile, &(decoder->subsampling_type), &(decoder->nW), &(decoder->nH)) ||
+                !_jpeg_prepare_region(jfile, option, &(decoder->block_size), &(decoder->roi)))
+                return _jpeg_stream_finish(decoder, false);
+            decoder->scan_origin = stream.pos;
+            decoder->state = _JPEG_STREAM_START;
+            return JPEG_STREAM_HEADER;
+        }
+        else if (decoder->state == _JPEG_STREAM_START) {
+            /* option->output can be set once the size of the image is known */
+            if (!_jpeg_prepare_output(jfile, option, &(decoder->output)))
+                return _jpeg_stream_finish(decoder, false);
+            decoder->scan_pos = decoder->scan_origin;
+            decoder->segment_end = -1;
+            jfile->rst_offsets.resize(0);
+            if (jfile->is_progressive) {
+                if (!_jpeg_prepare_coefficient_planes(jfile, decoder->nW, decoder->nH, decoder->subsampling_type,
+                    &(decoder->coeffs), &(decoder->scratch)))
+                    return _jpeg_stream_finish(decoder, false);
+                decoder->state = _JPEG_STREAM_SCAN;
+            }
+            else {
+                /* a single worker decodes the MCUs in order */
+                int num_threads = 1;
+                decoder->worker = _jpeg_prepare_workers(jfile, decoder->nW, decoder->nH, decoder->subsampling_type,
+                    decoder->block_size, &num_threads, option->idct_method, option->upsampling, &(decoder->roi),
+                    &(decoder->output), NULL, 0, &(decoder->scratch));
+                if (decoder->worker == NULL)
+                    return _jpeg_stream_finish(decoder, false);
+                decoder->mcu = decoder->worker->decode_first;
+                decoder->interval_mcu = -1;
+                decoder->state = _JPEG_STREAM_MCUS;
+            }
+        }
+        else if (decoder->state == _JPEG_STREAM_MCUS) {
+            int status = _jpeg_stream_decode_MCUs(decoder);
+            if (status == JPEG_STREAM_ERROR || status == JPEG_STREAM_DONE)
+                return _jpeg_stream_finish(decoder, status == JPEG_STREAM_DONE);
+            return status;
+        }
+        else if (decoder->state == _JPEG_STREAM_SCAN) {
+            /* a progressive scan is decoded once all of it is received */
+            if (!_jpeg_stream_scan_segment(decoder))
+                return JPEG_STREAM_NEED_DATA;
+            jfile->hstream = decoder->buffer + decoder->scan_origin;
+            jfile->hstream_size = decoder->segment_end;
+            if (!_jpeg_decode_scan(jfile, &(decoder->coeffs)))
+                return _jpeg_stream_finish(decoder, false);
+            jfile->num_scans++;
+            decoder->rendered = false;
+            decoder->markers_pos = decoder->scan_origin + decoder->segment_end;
+            decoder->walk_pos = decoder->markers_pos;
+            decoder->state = _JPEG_STREAM_MARKERS;
+            if (option->scan_callback != NULL) {
+                /* preview of the scans decoded so far */
+                if (!_jpeg_stream_render(decoder))
+                    return _jpeg_stream_finish(decoder, false);
+                if (!option->scan_callback(jfile, jfile->num_scans, option->scan_callback_data))
+                    return _jpeg_stream_finish(decoder, true); /* the preview becomes the image */
+            }
+        }
+        else if (decoder->state == _JPEG_STREAM_MARKERS) {
+            /* the scans before are decoded, their bytes are not needed anymore */
+            if (decoder->markers_pos >= _JPEG_STREAM_COMPACT_SIZE && decoder->markers_pos >= decoder->size / 2)
+                _jpeg_stream_discard(decoder, decoder->markers_pos);
+            /* as for the headers, parsed a single time once the segments are complete */
+            if (!_jpeg_stream_markers_ready(decoder->buffer, decoder->size, &(decoder->walk_pos)))
+                return JPEG_STREAM_NEED_DATA;
+            JPEG_STREAM stream;
+            stream.data = decoder->buffer;
+            stream.size = decoder->size;
+            stream.pos = decoder->markers_pos;
+            if (!_jpeg_read_markers(jfile, &stream, true))
+                return _jpeg_stream_finish(decoder, false);
+            if (jfile->scan_num_channels == 0) { /* EOI */
+                if (!decoder->rendered && !_jpeg_stream_render(decoder))
+                    return _jpeg_stream_finish(decoder, false);
+                return _jpeg_stream_finish(decoder, true);
+            }
+            if (!_jpeg_prepare_huffman_tables(jfile))
+                return _jpeg_stream_finish(decoder, false);
+            decoder->scan_origin = stream.pos;
+            decoder->scan_pos = stream.pos;
+            decoder->segment_end = -1;
+            jfile->rst_offsets.resize(0);
+            decoder->state = _JPEG_STREAM_SCAN;
+        }
+        else if (decoder->state == _JPEG_STREAM_DONE) {
+            return JPEG_STREAM_DONE;
+        }
+        else {
+            return JPEG_STREAM_ERROR;
+        }
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * */
+/* here are the interface functions for JPEG IO  */
+/* * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+jpeg_read: read and decode a JPEG image file.
+
+* If loading success, "is_valid" will be set to true, and
+  "image_data" contains the decoded raw image data (RGB).
+* Return NULL pointer if file does not exist or out of memory.
+* baseline (SOF0) and progressive (SOF2) Huffman coded JPEGs can be
+  read, arithmetic coded and lossless JPEGs cannot.
+* the whole file is loaded into memory first, then decoded
+  in the same way as jpeg_read_memory().
+* if option->output is set, the pixels are written to that buffer
+  in its pixel format and "image_data" stays NULL.
+* with option->scale_denom = 2, 4 or 8 the image is decoded at
+  1/2, 1/4 or 1/8 of its size, see "output_width" and "output_height".
+* option->upsampling = JPEG_UPSAMPLING_FANCY interpolates the chroma
+  of subsampled images like libjpeg does, instead of replicating it.
+* example:
+
+    JPEG_FILE* jfile = jpeg_read("example.jpg");
+    if (jfile == NULL){
+        printf("error, file not exist or out of memory.\n");
+    }
+    else if (jfile->is_valid == false) {
+        printf("error when loading JPEG file: %s\n", jfile->message);
+        ...
+    }
+    else {
+        save_PPM(jfile->image_data, "example.ppm");
+        ...
+    }
+*/
+JPEG_API JPEG_FILE* jpeg_read(const char * file, JPEG_READ_OPTION* option)
+{
+    Array<BYTE> data;
+    if (!_jpeg_load_file(file, &data)) {
+        return NULL;
+    }
+    JPEG_FILE * jfile = new JPEG_FILE();
+    if (jfile == NULL) {
+        return NULL; /* memory is full */
+    }
+    _jpeg_read_data(jfile, data.data(), data.size(), option, NULL);
+    return jfile;
+}
+/*
+jpeg_read_memory: decode a JPEG image that is already in memory.
+
+* "data" points to the content of a JPEG file and "size" is its
+  length in bytes. The data is only read while decoding and is not
+  referenced by the returned JPEG_FILE, it can be released right
+  after the call.
+* Return NULL pointer if the arguments are invalid or out of memory,
+  other errors are reported in the same way as jpeg_read().
+*/
+JPEG_API JPEG_FILE* jpeg_read_memory(const void* data, int size, JPEG_READ_OPTION* option)
+{
+    if (data == NULL || size <= 0) {
+        return NULL;
+    }
+    JPEG_FILE * jfile = new JPEG_FILE();
+    if (jfile == NULL) {
+        return NULL; /* memory is full */
+    }
+    _jpeg_read_data(jfile, (const BYTE*)data, size, option, NULL);
+    return jfile;
+}
+/*
+jpeg_read_mmap: read and decode a JPEG image file through a
+read-only memory mapping of the file.
+
+* Same as jpeg_read(), but the file is not copied into memory,
+  markers and the Huffman bitstream are read directly from the
+  mapped pages. The mapping is released before returning.
+* Return NULL pointer if file does not exist, cannot be mapped
+  or out of memory.
+*/
+JPEG_API JPEG_FILE* jpeg_read_mmap(const char* file, JPEG_READ_OPTION* option)
+{
+    JPEG_MAPPED_FILE mfile;
+    if (!_jpeg_map_file(file, &mfile)) {
+        return NULL;
+    }
+    JPEG_FILE * jfile = new JPEG_FILE();
+    if (jfile != NULL) {
+        _jpeg_read_data(jfile, mfile.data, mfile.size, option, NULL);
+    }
+    _jpeg_unmap_file(&mfile);
+    return jfile;
+}
+/*
+jpeg_read_batch: decode a list of JPEG images with a pool of threads.
+
+* each thread decodes whole images, one at a time, and keeps its
+  buffers from one image to the next.
+* "num_threads" threads are used (0: one per CPU core), option->num_threads
+  and option->output are ignored, see JPEG_BATCH_INPUT::output.
+* if "results" is not NULL, results[i] receives the JPEG_FILE of
+  inputs[i], to be released with jpeg_free().
+* if "callback" is not NULL, it is called from the decoding threads as
+  soon as an image is decoded. Without a completion array, the JPEG_FILE
+  passed to the callback is reused for the next image: it is only valid
+  during the call, and "image_data" is released afterwards unless the
+  callback takes it (and sets jfile->image_data to NULL).
+* returns false if an image cannot be decoded or out of memory.
+* example:
+
+    void on_decoded(int index, JPEG_FILE* jfile, void* user_data) {
+        if (jfile->is_valid) {
+            ... jfile->image_data ...
+        }
+    }
+
+    jpeg_read_batch(inputs, count, 0, NULL, NULL, on_decoded, NULL);
+*/
+JPEG_API bool jpeg_read_batch(JPEG_BATCH_INPUT* inputs, int count, int num_threads, JPEG_READ_OPTION* option,
+    JPEG_FILE** results, JPEG_BATCH_CALLBACK callback, void* user_data)
+{
+    if (count <= 0) {
+        return count == 0;
+    }
+    if (inputs == NULL) {
+        return false;
+    }
+    if (results != NULL) {
+        for (int i = 0; i < count; i++)
+            results[i] = NULL;
+    }
+    if (num_threads <= 0)
+        num_threads = int(std::thread::hardware_concurrency());
+    if (num_threads > count)
+        num_threads = count;
+    if (num_threads <= 0)
+        num_threads = 1;
+
+    std::atomic<int> next_input(0);
+    JPEG_BATCH_WORKER* workers = new JPEG_BATCH_WORKER[num_threads];
+    if (workers == NULL) {
+        return false; /* memory is full */
+    }
+    bool success = true;
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].inputs = inputs;
+        workers[t].count = count;
+        workers[t].next_input = &next_input;
+        if (option != NULL)
+            workers[t].option = (*option);
+        workers[t].option.num_threads = 1;
+        workers[t].results = results;
+        workers[t].callback = callback;
+        workers[t].user_data = user_data;
+        workers[t].jfile = NULL;
+        workers[t].success = false;
+        if (results == NULL) {
+            workers[t].jfile = new JPEG_FILE();
+            if (workers[t].jfile == NULL)
+                success = false;
+        }
+    }
+    if (success) {
+        /* the calling thread is one of the workers */
+        std::thread* threads = new std::thread[num_threads - 1];
+        for (int t = 1; t < num_threads; t++) {
+            threads[t - 1] = std::thread(_jpeg_batch_worker, &workers[t]);
+        }
+        _jpeg_batch_worker(&workers[0]);
+        for (int t = 1; t < num_threads; t++) {
+            threads[t - 1].join();
+        }
+        delete[] threads;
+        for (int t = 0; t < num_threads; t++) {
+            if (!workers[t].success)
+                success = false;
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        delete workers[t].jfile;
+    }
+    delete[] workers;
+    return success;
+}
+/*
+jpeg_create_decoder: create a decoding context for jpeg_decode_into().
+
+* "option" (NULL: default options) is used for every image, except
+  "output" which is given to each jpeg_decode_into() call.
+* Return NULL pointer if out of memory.
+*/
+JPEG_API JPEG_DECODER* jpeg_create_decoder(JPEG_READ_OPTION* option)
+{
+    JPEG_DECODER* decoder = new JPEG_DECODER();
+    if (decoder == NULL) {
+        return NULL; /* memory is full */
+    }
+    if (option != NULL)
+        decoder->option = (*option);
+    decoder->option.output = NULL;
+    decoder->jfile.image_data = NULL;
+    decoder->jfile.is_valid = false;
+    decoder->jfile.message[0] = '\0';
+    return decoder;
+}
+/*
+jpeg_decode_into: decode a JPEG image held in memory into "output".
+
+* the scratch memory of the decoder only grows, once it fits the
+  images nothing is allocated, and the quantization tables of the
+  previous image are reused if they are the same.
+* jpeg_decoder_file() tells the size of the image and the error
+  message if decoding fails.
+*/
+JPEG_API bool jpeg_decode_into(JPEG_DECODER* decoder, const void* data, int size, JPEG_PIXEL_BUFFER* output)
+{
+    JPEG_FILE* jfile = &(decoder->jfile);
+    if (output == NULL) {
+        jfile->is_valid = false;
+        jfile->message[0] = '\0';
+        _jpeg_dump_message(jfile, "invalid output buffer.");
+        return false;
+    }
+    decoder->option.output = output;
+    _jpeg_read_data(jfile, (const BYTE*)data, data != NULL ? size : 0, &(decoder->option), &(decoder->scratch));
+    decoder->option.output = NULL;
+    return jfile->is_valid;
+}
+/*
+jpeg_decode_file_into: same as jpeg_decode_into(), for a JPEG file,
+which is read into the scratch memory of the decoder.
+*/
+JPEG_API bool jpeg_decode_file_into(JPEG_DECODER* decoder, const char* file, JPEG_PIXEL_BUFFER* output)
+{
+    if (!_jpeg_load_file(file, &(decoder->scratch.file_data))) {
+        decoder->jfile.is_valid = false;
+        decoder->jfile.message[0] = '\0';
+        _jpeg_dump_message(&(decoder->jfile), "cannot open file.");
+        return false;
+    }
+    return jpeg_decode_into(decoder, decoder->scratch.file_data.data(), decoder->scratch.file_data.size(), output);
+}
+/*
+jpeg_decoder_file: information about the last image decoded by
+"decoder" (size, channels, message), owned by the decoder.
+*/
+JPEG_API JPEG_FILE* jpeg_decoder_file(JPEG_DECODER* decoder)
+{
+    return &(decoder->jfile);
+}
+/*
+jpeg_free_decoder: release a decoder and all its memory.
+*/
+JPEG_API void jpeg_free_decoder(JPEG_DECODER* decoder)
+{
+    delete decoder;
+}
+/*
+jpeg_create_stream_decoder: create a decoder that is fed the data of
+a single image as it arrives, see jpeg_stream_step().
+
+* "option" (NULL: default options) is copied, "output" is only read
+  by the step that follows JPEG_STREAM_HEADER.
+* Return NULL pointer if out of memory.
+*/
+JPEG_API JPEG_STREAM_DECODER* jpeg_create_stream_decoder(JPEG_READ_OPTION* option)
+{
+    JPEG_STREAM_DECODER* decoder = new JPEG_STREAM_DECODER();
+    if (decoder == NULL) {
+        return NULL; /* memory is full */
+    }
+    if (option != NULL)
+        decoder->option = (*option);
+    decoder->state = _JPEG_STREAM_HEADERS;
+    decoder->buffer = NULL;
+    decoder->size = 0;
+    decoder->capacity = 0;
+    decoder->markers_pos = 0;
+    decoder->walk_pos = 2; /* after SOI */
+    decoder->rows = 0;
+    decoder->roi.x = decoder->roi.y = 0;
+    decoder->roi.width = decoder->roi.height = 0;
+    decoder->scan_origin = 0;
+    decoder->scan_pos = 0;
+    decoder->segment_end = -1;
+    decoder->worker = NULL;
+    decoder->mcu = 0;
+    decoder->interval_mcu = -1;
+    decoder->interval_pos = 0;
+    decoder->wanted_size = 0;
+    _jpeg_bit_reader_init(&(decoder->bit_reader), NULL, 0);
+    decoder->rendered = false;
+    decoder->jfile.image_data = NULL;
+    decoder->jfile.is_valid = false;
+    decoder->jfile.image_width = 0;
+    decoder->jfile.image_height = 0;
+    decoder->jfile.output_width = 0;
+    decoder->jfile.output_height = 0;
+    decoder->jfile.hstream = NULL;
+    decoder->jfile.hstream_size = 0;
+    decoder->jfile.message[0] = '\0';
+    return decoder;
+}
+/*
+jpeg_stream_feed: append the next "size" bytes of the image to the
+data of the decoder, they are copied and "data" can be released as
+soon as the function returns.
+
+* returns false if out of memory.
+*/
+JPEG_API bool jpeg_stream_feed(JPEG_STREAM_DECODER* decoder, const void* data, int size)
+{
+    if (size < 0 || (data == NULL && size != 0) || size > 0x7FFFFFFF - decoder->size)
+        return false;
+    if (decoder->size + size > decoder->capacity) {
+        /* the buffer grows geometrically, feeding small pieces stays linear */
+        long long capacity = 2LL * decoder->capacity;
+        if (capacity < decoder->size + size)
+            capacity = decoder->size + size;
+        if (capacity < 4096)
+            capacity = 4096;
+        if (capacity > 0x7FFFFFFF)
+            capacity = 0x7FFFFFFF;
+        BYTE* buffer = (BYTE*)realloc(decoder->buffer, size_t(capacity));
+        if (buffer == NULL)
+            return false;
+        decoder->buffer = buffer;
+        decoder->capacity = int(capacity);
+    }
+    if (size > 0)
+        memcpy(decoder->buffer + decoder->size, data, size);
+    decoder->size += size;
+    return true;
+}
+/*
+jpeg_stream_set_output: set the output buffer once the size of the image is known,
+it is only read when the decoding starts (_JPEG_STREAM_START).
+*/
+JPEG_API bool jpeg_stream_set_output(JPEG_STREAM_DECODER* decoder, JPEG_PIXEL_BUFFER* output)
+{
+    if (decoder->state != _JPEG_STREAM_HEADERS && decoder->state != _JPEG_STREAM_START)
+        return false;
+    decoder->option.output = output;
+    return true;
+}
+/*
+jpeg_stream_step: decode as much as the data fed so far allows, and
+return as soon as there is something to tell (JPEG_STREAM_*).
+*/
+JPEG_API int jpeg_stream_step(JPEG_STREAM_DECODER* decoder)
+{
+    return _jpeg_stream_step(decoder);
+}
+/*
+jpeg_stream_rows: number of rows at the top of the image that are
+completely output.
+*/
+JPEG_API int jpeg_stream_rows(JPEG_STREAM_DECODER* decoder)
+{
+    return decoder->rows;
+}
+/*
+jpeg_stream_file: headers, status and message of the image, owned by
+the decoder. "image_data" is released with the decoder unless the
+caller sets it to NULL (and releases it with free_image()).
+*/
+JPEG_API JPEG_FILE* jpeg_stream_file(JPEG_STREAM_DECODER* decoder)
+{
+    return &(decoder->jfile);
+}
+/*
+jpeg_free_stream_decoder: release a stream decoder and all its memory.
+*/
+JPEG_API void jpeg_free_stream_decoder(JPEG_STREAM_DECODER* decoder)
+{
+    if (decoder == NULL)
+        return;
+    free_image(decoder->jfile.image_data);
+    free(decoder->buffer);
+    delete decoder;
+}
+/*
+jpeg_read_coefficients: read the quantized DCT coefficients of a JPEG
+image file, the pixels are not reconstructed.
+
+* Return NULL pointer if file does not exist or out of memory,
+  otherwise check "is_valid" and "message".
+* the coefficients of each component are stored block by block, see
+  JPEG_COEFF_PLANE. They are multiplied by the quantization table
+  "qtabs[plane.qtab_id]" (same layout) to get the DCT coefficients.
+* example:
+
+    JPEG_COEFFICIENTS* coeffs = jpeg_read_coefficients("example.jpg");
+    if (coeffs != NULL && coeffs->is_valid) {
+        JPEG_COEFF_PLANE* Y = &(coeffs->planes[0]);
+        short DC = Y->data[(by * Y->width_in_blocks + bx) * 64];
+        ...
+    }
+    jpeg_free_coefficients(coeffs);
+*/
+JPEG_API JPEG_COEFFICIENTS* jpeg_read_coefficients(const char* file)
+{
+    JPEG_MAPPED_FILE mfile;
+    if (!_jpeg_map_file(file, &mfile)) {
+        return NULL;
+    }
+    JPEG_COEFFICIENTS* coeffs = new JPEG_COEFFICIENTS();
+    if (coeffs != NULL) {
+        _jpeg_read_coefficients_data(coeffs, mfile.data, mfile.size);
+    }
+    _jpeg_unmap_file(&mfile);
+    return coeffs;
+}
+/*
+jpeg_read_coefficients_memory: same as jpeg_read_coefficients(), for a
+JPEG image in memory.
+*/
+JPEG_API JPEG_COEFFICIENTS* jpeg_read_coefficients_memory(const void* data, int size)
+{
+    if (data == NULL || size <= 0) {
+        return NULL;
+    }
+    JPEG_COEFFICIENTS* coeffs = new JPEG_COEFFICIENTS();
+    if (coeffs != NULL) {
+        _jpeg_read_coefficients_data(coeffs, (const BYTE*)data, size);
+    }
+    return coeffs;
+}
+/*
+jpeg_free_coefficients: release the coefficients read by jpeg_read_coefficients().
+*/
+JPEG_API void jpeg_free_coefficients(JPEG_COEFFICIENTS* coeffs)
+{
+    if (coeffs == NULL)
+        return;
+    for (int ch = 0; ch < 3; ch++)
+        free(coeffs->planes[ch].data);
+    delete coeffs;
+}
+/*
+jpeg_transform_coefficients: apply one of the JPEG_TRANSFORM_* transforms to the
+coefficients, in place.
+
+* every transform is a transposition (optional) followed by a horizontal
+  and/or vertical flip, all done block by block on the coefficients.
+* a flip would move the partial MCU at the right (bottom) edge of the
+  image to the left (top) edge, so that partial MCU is trimmed away (see
+  "jpegtran -trim"). An image narrower (shorter) than an MCU cannot be
+  flipped in that direction without decoding it, the transform fails and
+  the coefficients are left unchanged.
+*/
+JPEG_API bool jpeg_transform_coefficients(JPEG_COEFFICIENTS* coeffs, int transform)
+{
+    /* transposition, horizontal flip and vertical flip of each transform */
+    static const bool transposes[8] = { false, false, false, true, true, true, false, true };
+    static const bool flips_h[8] = { false, true, false, false, true, true, true, false };
+    static const bool flips_v[8] = { false, false, true, false, true, false, true, true };
+
+    if (coeffs == NULL)
+        return false;
+    if (!coeffs->is_valid) {
+        _jpeg_append_message(coeffs->message, "no coefficients to transform.");
+        return false;
+    }
+    if (transform < JPEG_TRANSFORM_NONE || transform > JPEG_TRANSFORM_ROT_270) {
+        _jpeg_append_message(coeffs->message, "unknown transform.");
+        return false;
+    }
+    bool transpose = transposes[transform], flip_h = flips_h[transform], flip_v = flips_v[transform];
+
+    /* size of the transformed image */
+    int max_hsample = transpose ? coeffs->max_vsample : coeffs->max_hsample;
+    int max_vsample = transpose ? coeffs->max_hsample : coeffs->max_vsample;
+    int width = transpose ? coeffs->image_height : coeffs->image_width;
+    int height = transpose ? coeffs->image_width : coeffs->image_height;
+    if ((flip_h && width < 8 * max_hsample) || (flip_v && height < 8 * max_vsample)) {
+        _jpeg_append_message(coeffs->message, "image smaller than one MCU cannot be flipped losslessly.");
+        return false;
+    }
+    if (flip_h) width -= width % (8 * max_hsample);
+    if (flip_v) height -= height % (8 * max_vsample);
+    int nW = (width + 8 * max_hsample - 1) / (8 * max_hsample);
+    int nH = (height + 8 * max_vsample - 1) / (8 * max_vsample);
+
+    /* output block (bx, by) is the transposed block (tx, ty), which is the */
+    /* input block (ty, tx) if transposing or (tx, ty) otherwise */
+    JPEG_COEFF_PLANE planes[3];
+    for (int ch = 0; ch < coeffs->num_channels; ch++) {
+        JPEG_COEFF_PLANE* in = &(coeffs->planes[ch]);
+        JPEG_COEFF_PLANE* out = &(planes[ch]);
+        out->hsample = transpose ? in->vsample : in->hsample;
+        out->vsample = transpose ? in->hsample : in->vsample;
+        out->qtab_id = in->qtab_id;
+        out->width_in_blocks = nW * out->hsample;
+        out->height_in_blocks = nH * out->vsample;
+        out->data = (short*)malloc(sizeof(short) * 64 * out->width_in_blocks * out->height_in_blocks);
+        if (out->data == NULL) {
+            for (int i = 0; i < ch; i++)
+                free(planes[i].data);
+            _jpeg_append_message(coeffs->message, "out of memory.");
+            return false;
+        }
+        for (int by = 0; by < out->height_in_blocks; by++) {
+            for (int bx = 0; bx < out->width_in_blocks; bx++) {
+                int tx = flip_h ? out->width_in_blocks - 1 - bx : bx;
+                int ty = flip_v ? out->height_in_blocks - 1 - by : by;
+                int ix = transpose ? ty : tx, iy = transpose ? tx : ty;
+                _jpeg_transform_block(in->data + (iy * in->width_in_blocks + ix) * 64,
+                    out->data + (by * out->width_in_blocks + bx) * 64, transpose, flip_h, flip_v);
+            }
+        }
+    }
+    for (int ch = 0; ch < coeffs->num_channels; ch++) {
+        free(coeffs->planes[ch].data);
+        coeffs->planes[ch] = planes[ch];
+    }
+    if (transpose) {
+        for (int t = 0; t < 4; t++) {
+            INT_8x8 qtab = coeffs->qtabs[t];
+            for (int u = 0; u < 8; u++)
+                for (int v = 0; v < 8; v++)
+                    coeffs->qtabs[t].data[u][v] = qtab.data[v][u];
+        }
+    }
+    coeffs->image_width = width;
+    coeffs->image_height = height;
+    coeffs->max_hsample = max_hsample;
+    coeffs->max_vsample = max_vsample;
+    coeffs->MCUs_per_row = nW;
+    coeffs->MCU_rows = nH;
+    return true;
+}
+/*
+jpeg_write_coefficients: save the coefficients read by jpeg_read_coefficients()
+(possibly modified or transformed) as a baseline JPEG file.
+
+* the Huffman tables are optimized for the coefficients, the markers
+  that do not describe the image (APPn, COM) are not written.
+* Return false if the layout of the coefficients is invalid or the file
+  cannot be written, the reason is in coeffs->message.
+*/
+JPEG_API bool jpeg_write_coefficients(JPEG_COEFFICIENTS* coeffs, const char* file)
+{
+    if (coeffs == NULL)
+        return false;
+    Bitstream jpeg;
+    if (!_jpeg_write_coefficients(coeffs, NULL, 0, &jpeg))
+        return false;
+
+    FILE* fp = fopen(file, "wb");
+    if (fp == NULL) {
+        _jpeg_append_message(coeffs->message, "cannot open file.");
+        return false;
+    }
+    Array<BYTE> packedBitstream = jpeg.pack();
+    bool success = _jpeg_write_fp(fp, packedBitstream.size(), packedBitstream.data());
+    fclose(fp);
+    return success;
+}
+/*
+jpeg_transform: losslessly rotate or flip a JPEG image file, the
+coefficients are read, transformed by jpeg_transform_coefficients() and
+written by jpeg_write_coefficients(), no pixel is ever decoded.
+*/
+JPEG_API bool jpeg_transform(const char* src, const char* dst, int transform)
+{
+    JPEG_COEFFICIENTS* coeffs = jpeg_read_coefficients(src);
+    if (coeffs == NULL)
+        return false;
+    bool success = coeffs->is_valid &&
+        jpeg_transform_coefficients(coeffs, transform) &&
+        jpeg_write_coefficients(coeffs, dst);
+    jpeg_free_coefficients(coeffs);
+    return success;
+}
+/*
+jpeg_optimize: rewrite a JPEG image file with Huffman tables optimized
+for its coefficients, the image is not altered.
+
+* the coefficients are entropy decoded and encoded again, no IDCT or
+  color conversion is done. The APPn and COM markers (EXIF, ICC
+  profile, comments, ...) are copied.
+* "src" and "dst" can be the same file.
+* if the rewritten file is not smaller (the source is already optimized,
+  or progressive, which this baseline rewrite cannot beat), "src" is
+  copied to "dst" unchanged.
+*/
+JPEG_API bool jpeg_optimize(const char* src, const char* dst)
+{
+    JPEG_MAPPED_FILE mfile;
+    if (!_jpeg_map_file(src, &mfile)) {
+        return false;
+    }
+    JPEG_COEFFICIENTS* coeffs = new JPEG_COEFFICIENTS();
+    Bitstream jpeg;
+    Array<BYTE> packedBitstream;
+    bool success = false;
+    if (coeffs != NULL) {
+        _jpeg_read_coefficients_data(coeffs, mfile.data, mfile.size);
+        success = coeffs->is_valid && _jpeg_write_coefficients(coeffs, mfile.data, mfile.size, &jpeg);
+        jpeg_free_coefficients(coeffs);
+    }
+    if (success) {
+        packedBitstream = jpeg.pack();
+        if (packedBitstream.size() >= mfile.size) { /* no gain, keep the original bytes */
+            success = packedBitstream.resize(mfile.size);
+            if (success)
+                memcpy(packedBitstream.data(), mfile.data, mfile.size);
+        }
+    }
+    _jpeg_unmap_file(&mfile);
+    if (!success)
+        return false;
+
+    FILE* fp = fopen(dst, "wb");
+    if (fp == NULL)
+        return false;
+    success = _jpeg_write_fp(fp, packedBitstream.size(), packedBitstream.data());
+    fclose(fp);
+    return success;
+}
+/*
+jpeg_probe: read the headers of a JPEG image file without decoding it.
+
+* the file is memory mapped and the markers are parsed until the SOS
+  header, so only the pages holding the headers are actually read.
+* on success, "info" holds the image size, the sampling factors, the
+  restart interval, a summary of the tables and the offset of the
+  entropy-coded data.
+* example:
+
+    JPEG_INFO info;
+    if (jpeg_probe("example.jpg", &info))
+        printf("%d x %d, %d channel(s)\n", info.image_width, info.image_height, info.num_channels);
+    else
+        printf("invalid JPEG file: %s\n", info.message);
+*/
+JPEG_API bool jpeg_probe(const char* file, JPEG_INFO* info)
+{
+    JPEG_MAPPED_FILE mfile;
+    if (!_jpeg_map_file(file, &mfile)) {
+        memset(info, 0, sizeof(JPEG_INFO));
+        _jpeg_append_message(info->message, "cannot open file.");
+        return false;
+    }
+    bool success = _jpeg_probe_data(mfile.data, mfile.size, info);
+    _jpeg_unmap_file(&mfile);
+    return success;
+}
+/*
+jpeg_probe_memory: read the headers of a JPEG image in memory, see jpeg_probe().
+*/
+JPEG_API bool jpeg_probe_memory(const void* data, int size, JPEG_INFO* info)
+{
+    if (data == NULL || size < 0) {
+        memset(info, 0, sizeof(JPEG_INFO));
+        _jpeg_append_message(info->message, "invalid arguments.");
+        return false;
+    }
+    return _jpeg_probe_data((const BYTE*)data, size, info);
+}
+/*
+jpeg_free: unload a JPEG file, free all resources allocated.
+*/
+JPEG_API void jpeg_free(JPEG_FILE * jfile)
+{
+    free_image(jfile->image_data);
+    delete jfile;
+}
+/*
+jpeg_save: save an image data as JPEG format.
+
+* example:
+
+    JPEG_SAVE_OPTION option;
+    option.save_preset = JPEG_SAVE_PRESET_MEDIUM;  <= using medium quality preset
+    jpeg_save(image, &option, "example.jpg");      <= saving image as "example.jpg"
 
   or you can define the quantization table yourself:
 
@@ -2437,42 +6082,13 @@ JPEG_API bool jpeg_save(RAW_IMAGE* image, JPEG_SAVE_OPTION* option, const char*
     _jpeg_forward_compression(image, option, restart_interval, &qCoeffs);
 
     /* define Huffman tables */
-    JPEG_HUFFMAN_TABLE dctab, actab;
     Array<BYTE>      DC_symbols, AC_symbols;
     Array<Bitstream> DC_codes, AC_codes;
     Array<int>       DC_bins, AC_bins;
-    _jpeg_generate_huffman_tables(&qCoeffs,
+    _jpeg_generate_huffman_tables(&qCoeffs, 4, 0x07,
         &DC_symbols, &DC_codes, &DC_bins,
         &AC_symbols, &AC_codes, &AC_bins);
-    /* fill the dc and ac table */
-    dctab.offsets[0] = 0; actab.offsets[0] = 0;
-    for (int i = 1; i < 17; i++)
-        dctab.offsets[i] = dctab.offsets[i - 1] + DC_bins[i];
-    for (int i = 1; i < 17; i++)
-        actab.offsets[i] = actab.offsets[i - 1] + AC_bins[i];
-    for (int i = 0; i < DC_symbols.size(); i++)
-        dctab.symbols[i] = DC_symbols[i];
-    for (int i = 0; i < AC_symbols.size(); i++)
-        actab.symbols[i] = AC_symbols[i];
-    /* write to bitstream */
-    jpeg.appendBits(0xFF, 8); jpeg.appendBits(DHT, 8);
-    int tab_len = 2 + (1 + 16 + dctab.offsets[16]) +
-        (1 + 16 + actab.offsets[16]); /* 2 tables */
-    jpeg.appendBits(WORD(tab_len), 16);
-    /* DC huffman table */
-    jpeg.appendBits(0, 4); /* DC Huffman table */
-    jpeg.appendBits(0, 4); /* table ID = 0 */
-    for (int i = 0; i < 16; i++)
-        jpeg.appendBits(BYTE(dctab.offsets[i + 1] - dctab.offsets[i]), 8);
-    for (int i = 0; i < dctab.offsets[16]; i++)
-        jpeg.appendBits(dctab.symbols[i], 8);
-    /* AC huffman table */
-    jpeg.appendBits(1, 4); /* AC Huffman table */
-    jpeg.appendBits(0, 4); /* table ID = 0 */
-    for (int i = 0; i < 16; i++)
-        jpeg.appendBits(BYTE(actab.offsets[i + 1] - actab.offsets[i]), 8);
-    for (int i = 0; i < actab.offsets[16]; i++)
-        jpeg.appendBits(actab.symbols[i], 8);
+    _jpeg_write_huffman_tables(&jpeg, 0, &DC_symbols, &DC_bins, &AC_symbols, &AC_bins);
 
     /* define start of scan */
     jpeg.appendBits(0xFF, 8); jpeg.appendBits(SOS, 8);
@@ -2490,8 +6106,8 @@ JPEG_API bool jpeg_save(RAW_IMAGE* image, JPEG_SAVE_OPTION* option, const char*
     jpeg.appendBits(0, 8);  /* successive approximation (H/L) */
     /* write huffman bitstream */
     Bitstream bs;
-    _jpeg_generate_huffman_bitstream(&qCoeffs,
-        &DC_symbols, &DC_codes, &AC_symbols, &AC_codes, restart_interval, &bs);
+    _jpeg_generate_huffman_bitstream(&qCoeffs, 4,
+        &DC_symbols, &DC_codes, &AC_symbols, &AC_codes, NULL, restart_interval, &bs);
     jpeg.appendBitstream(bs, bs.size());
     jpeg.alignWrite();
 
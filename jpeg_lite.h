@@ -1,7 +1,7 @@
 /*
 jpeg_io.h: A simple JPEG IO utility.
-Only supports Huffman encoded baseline DCT JPEGs.
-Progressive, arithmetic JPEGs are not supported.
+Reads Huffman encoded baseline and progressive DCT JPEGs.
+Arithmetic coded and lossless JPEGs are not supported.
 */
 #pragma once
 
@@ -159,11 +159,20 @@ struct JPEG_CHANNEL {
     bool is_used;
 };
 
+#define _JPEG_HUFF_LOOKAHEAD 9 /* number of bits resolved by a single table lookup when decoding */
+
 struct JPEG_HUFFMAN_TABLE {
     BYTE offsets[17];
     BYTE symbols[176];       /* Huffman symbols (nZ, length) */
     unsigned int codes[176]; /* binary Huffman codes */
     bool is_used;
+
+    /* decoding tables, generated together with the Huffman codes */
+    WORD lookup[1 << _JPEG_HUFF_LOOKAHEAD]; /* indexed by the next 9 bits: (code length << 8) | symbol,
+                                               0 if the code is longer than 9 bits */
+    int maxcode[18];         /* largest code of each length (-1 if no code has this length) */
+    int mincode[17];         /* smallest code of each length */
+    int valptr[17];          /* index of the first symbol of each length in "symbols" */
 };
 
 #define _JPEG_MSG_LEN        256
@@ -173,6 +182,7 @@ struct JPEG_FILE {
     /* most useful information */
     bool is_valid;                 /* is JPEG file valid */
     int image_width, image_height; /* image width and height measured in pixels */
+    int output_width, output_height; /* size of the decoded image (smaller when scaled or cropped) */
     int num_channels;              /* number of color channels */
     RAW_IMAGE* image_data;         /* decoded raw image data (RGB, 8 bits per channel) */
     char message[_JPEG_MSG_LEN];   /* JPEG loading message, stores error string */
@@ -180,11 +190,23 @@ struct JPEG_FILE {
     /* advanced information */
     bool zero_start;               /* is channel ID starts with 0 instead of 1 (default=false) */
     INT_8x8 qtabs[4];              /* quantization tables (4 at maximum) */
+    int qtab_bits[4];              /* precision of each quantization table, 8 or 16 bits (0: not defined) */
     JPEG_HUFFMAN_TABLE dctabs[4];  /* Huffman DC tables */
     JPEG_HUFFMAN_TABLE actabs[4];  /* Huffman AC tables */
+    const JPEG_HUFFMAN_TABLE* dctab_decode[4]; /* built decoding tables of dctabs, shared between images */
+    const JPEG_HUFFMAN_TABLE* actab_decode[4]; /* (or dctabs/actabs themselves), NULL if not defined */
     int restart_interval;          /* DC coefficient restart interval */
     JPEG_CHANNEL channels[4];      /* channel information */
-    Array<BYTE> hstream;           /* Huffman bitstream */
+    int scan_offset;               /* byte offset of the entropy-coded data (after the SOS header) in the file */
+    const BYTE* hstream;           /* Huffman bitstream, points into the input data (only valid while decoding) */
+    int hstream_size;              /* size of the Huffman bitstream in bytes */
+    Array<int> rst_offsets;        /* byte offset of each restart marker (RST0~7) in hstream */
+    bool is_progressive;           /* progressive JPEG (SOF2), the coefficients are sent in several scans */
+    int num_scans;                 /* number of scans of a progressive JPEG decoded so far */
+    int scan_num_channels;         /* channels of the current scan (indices into "channels", */
+    int scan_channels[4];          /* in coding order), 0 once the EOI marker is reached */
+    int scan_start, scan_end;      /* spectral selection of the current scan, zigzag indices (baseline: 0~63) */
+    int scan_high, scan_low;       /* successive approximation of the current scan, bit positions Ah and Al */
 
 };
 
@@ -205,6 +227,211 @@ struct JPEG_SAVE_OPTION {
 
 };
 
+#define JPEG_IDCT_FLOAT 0 /* floating point AAN IDCT, vectorized with SSE2/AVX when available (default) */
+#define JPEG_IDCT_FIXED 1 /* 32-bit fixed-point AAN IDCT, faster, accurate to IEEE 1180 limits */
+
+#define JPEG_UPSAMPLING_BOX   0 /* chroma samples are replicated, merged with the color conversion (default) */
+#define JPEG_UPSAMPLING_FANCY 1 /* triangle filter as in libjpeg, smoother chroma edges */
+
+#define JPEG_PIXEL_PLANAR_RGB 0 /* three separate R, G and B planes (the layout of RAW_IMAGE) */
+#define JPEG_PIXEL_RGB        1 /* 3 bytes per pixel: R, G, B */
+#define JPEG_PIXEL_BGR        2 /* 3 bytes per pixel: B, G, R */
+#define JPEG_PIXEL_RGBA       3 /* 4 bytes per pixel: R, G, B, A (A = 255) */
+#define JPEG_PIXEL_BGRA       4 /* 4 bytes per pixel: B, G, R, A (A = 255) */
+#define JPEG_PIXEL_GRAY       5 /* 1 byte per pixel: luminance (Y), the chrominance is not decoded */
+
+/* lossless transforms of jpeg_transform(), an image with the EXIF orientation tag N is */
+/* displayed upright by: 2 FLIP_H, 3 ROT_180, 4 FLIP_V, 5 TRANSPOSE, 6 ROT_90, */
+/* 7 TRANSVERSE, 8 ROT_270 */
+#define JPEG_TRANSFORM_NONE       0
+#define JPEG_TRANSFORM_FLIP_H     1 /* mirror left-right */
+#define JPEG_TRANSFORM_FLIP_V     2 /* mirror top-bottom */
+#define JPEG_TRANSFORM_TRANSPOSE  3 /* mirror across the top-left to bottom-right diagonal */
+#define JPEG_TRANSFORM_TRANSVERSE 4 /* mirror across the top-right to bottom-left diagonal */
+#define JPEG_TRANSFORM_ROT_90     5 /* rotate 90 degrees clockwise */
+#define JPEG_TRANSFORM_ROT_180    6 /* rotate 180 degrees */
+#define JPEG_TRANSFORM_ROT_270    7 /* rotate 270 degrees clockwise */
+
+/* caller-provided memory that receives the decoded pixels */
+struct JPEG_PIXEL_BUFFER {
+
+    /* pixel format, one of JPEG_PIXEL_* */
+    int format;
+
+    /* first pixel of the first row, for JPEG_PIXEL_PLANAR_RGB data[0], */
+    /* data[1] and data[2] are the R, G and B planes, otherwise only */
+    /* data[0] is used */
+    unsigned char* data[3];
+
+    /* distance in bytes between the first pixels of two consecutive rows */
+    /* (of the same plane) */
+    int stride;
+
+    /* size of the buffer in pixels, decoding fails if the image is larger */
+    int width, height;
+
+    JPEG_PIXEL_BUFFER() {
+        format = JPEG_PIXEL_RGB;
+        data[0] = data[1] = data[2] = NULL;
+        stride = 0;
+        width = height = 0;
+    }
+};
+
+/* called after each scan of a progressive JPEG, see JPEG_READ_OPTION::scan_callback */
+typedef bool (*JPEG_SCAN_CALLBACK)(JPEG_FILE* jfile, int scan, void* user_data);
+
+struct JPEG_READ_OPTION {
+
+    /* number of threads used for decoding (0: one per CPU core, default). */
+    /* images without restart markers (DRI) are always decoded by a single */
+    /* thread, otherwise the restart intervals are shared between threads */
+    int num_threads;
+
+    /* IDCT implementation, JPEG_IDCT_FLOAT or JPEG_IDCT_FIXED */
+    int idct_method;
+
+    /* if not NULL, the pixels are written to this buffer in its format */
+    /* and "image_data" is left NULL (default: NULL, decode to image_data) */
+    JPEG_PIXEL_BUFFER* output;
+
+    /* decode at 1/scale_denom of the image size: 1 (default), 2, 4 or 8. */
+    /* the blocks are transformed with a reduced 4x4, 2x2 or DC-only IDCT */
+    /* (idct_method is ignored) and the subsampled chroma directly at the */
+    /* output resolution, the output is ceil(size / scale_denom) */
+    int scale_denom;
+
+    /* region of interest in decoded (scaled) pixels, only this rectangle */
+    /* is output and becomes the image (roi_width = 0: whole image, default) */
+    /* the bitstream is not decoded past the region, and with restart markers */
+    /* decoding starts at the restart interval containing the region */
+    int roi_x, roi_y;
+    int roi_width, roi_height;
+
+    /* chroma upsampling of subsampled images, JPEG_UPSAMPLING_BOX or */
+    /* JPEG_UPSAMPLING_FANCY (slower, the rows around each thread's part */
+    /* of the image are decoded twice) */
+    int upsampling;
+
+    /* progressive JPEGs: if not NULL, called after every scan once the */
+    /* image decoded from the scans read so far ("scan" of them) has been */
+    /* output to "image_data" or "output", so that a preview can be painted. */
+    /* Returning false stops decoding, the last preview becomes the image */
+    JPEG_SCAN_CALLBACK scan_callback;
+    void* scan_callback_data;
+
+    JPEG_READ_OPTION() {
+        num_threads = 0;
+        idct_method = JPEG_IDCT_FLOAT;
+        output = NULL;
+        scale_denom = 1;
+        roi_x = roi_y = 0;
+        roi_width = roi_height = 0;
+        upsampling = JPEG_UPSAMPLING_BOX;
+        scan_callback = NULL;
+        scan_callback_data = NULL;
+    }
+};
+
+/* header information returned by jpeg_probe(), the image is not decoded */
+struct JPEG_INFO {
+    bool is_valid;                 /* are the headers valid (up to the SOS marker) */
+    int image_width, image_height; /* image width and height measured in pixels */
+    int num_channels;              /* number of color channels */
+    bool is_progressive;           /* progressive JPEG (SOF2) */
+    JPEG_CHANNEL channels[4];      /* sampling factors and table IDs of each channel */
+    int restart_interval;          /* DC coefficient restart interval (0: no restart markers) */
+    int qtab_bits[4];              /* precision of each quantization table, 8 or 16 bits (0: not defined) */
+    int dctab_symbols[4];          /* number of symbols in each Huffman DC table (0: not defined) */
+    int actab_symbols[4];          /* number of symbols in each Huffman AC table (0: not defined) */
+    int scan_offset;               /* byte offset of the entropy-coded data in the file */
+    char message[_JPEG_MSG_LEN];   /* error string */
+};
+
+/* quantized DCT coefficients of a color component, see jpeg_read_coefficients() */
+struct JPEG_COEFF_PLANE {
+    int hsample, vsample;          /* sampling factors: blocks of the component in an MCU */
+    int qtab_id;                   /* quantization table of the component (JPEG_COEFFICIENTS::qtabs) */
+    int width_in_blocks;           /* 8x8 blocks in a row, whole MCUs (blocks past the image included) */
+    int height_in_blocks;          /* number of rows of blocks */
+    short* data;                   /* 64 coefficients per block in natural (row-major) order, the */
+                                   /* block (bx, by) starts at data[(by * width_in_blocks + bx) * 64] */
+
+    JPEG_COEFF_PLANE() {
+        hsample = vsample = 0;
+        qtab_id = 0;
+        width_in_blocks = height_in_blocks = 0;
+        data = NULL;
+    }
+};
+
+/* quantized DCT coefficients of a JPEG image, returned by jpeg_read_coefficients() */
+struct JPEG_COEFFICIENTS {
+    bool is_valid;                 /* are the coefficients successfully read */
+    int image_width, image_height; /* image width and height measured in pixels */
+    int num_channels;              /* 1 (grayscale, only planes[0]) or 3 (Y, Cb, Cr) */
+    int max_hsample, max_vsample;  /* an MCU covers (8 * max_hsample) x (8 * max_vsample) pixels */
+                                   /* (grayscale images: 1 x 1, whatever the SOF marker says) */
+    int MCUs_per_row, MCU_rows;    /* number of MCUs in the image */
+    int restart_interval;          /* DC coefficient restart interval of the file (0: none) */
+    INT_8x8 qtabs[4];              /* quantization tables (natural order, like the blocks) */
+    int qtab_bits[4];              /* precision of each quantization table, 8 or 16 bits (0: not defined) */
+    JPEG_COEFF_PLANE planes[3];    /* coefficients of each component */
+    char message[_JPEG_MSG_LEN];   /* loading message, stores error string */
+
+    JPEG_COEFFICIENTS() {
+        is_valid = false;
+        image_width = image_height = 0;
+        num_channels = 0;
+        max_hsample = max_vsample = 0;
+        MCUs_per_row = MCU_rows = 0;
+        restart_interval = 0;
+        for (int i = 0; i < 4; i++)
+            qtab_bits[i] = 0;
+        message[0] = '\0';
+    }
+};
+
+/* an image of a batch decoded by jpeg_read_batch() */
+struct JPEG_BATCH_INPUT {
+
+    /* path of the JPEG file, or NULL to decode "data" */
+    const char* file;
+
+    /* content of a JPEG file in memory (used when "file" is NULL), it */
+    /* must stay valid until jpeg_read_batch() returns */
+    const void* data;
+    int size;
+
+    /* if not NULL, the pixels of this image are written to this buffer */
+    /* (see JPEG_READ_OPTION::output), otherwise to "image_data" */
+    JPEG_PIXEL_BUFFER* output;
+
+    JPEG_BATCH_INPUT() {
+        file = NULL;
+        data = NULL;
+        size = 0;
+        output = NULL;
+    }
+};
+
+/* decoding context kept between images, see jpeg_create_decoder() */
+struct JPEG_DECODER;
+
+/* decoder fed with the data of an image as it arrives, see jpeg_create_stream_decoder() */
+struct JPEG_STREAM_DECODER;
+
+/* status returned by jpeg_stream_step() */
+#define JPEG_STREAM_ERROR     -1 /* decoding failed, see the message of jpeg_stream_file() */
+#define JPEG_STREAM_NEED_DATA  0 /* the data fed so far is decoded, feed more */
+#define JPEG_STREAM_HEADER     1 /* the headers are read, the size of the image is known */
+#define JPEG_STREAM_ROWS       2 /* more rows are output, see jpeg_stream_rows() */
+#define JPEG_STREAM_DONE       3 /* the image is complete */
+
+/* called by jpeg_read_batch() when inputs[index] is decoded, "jfile" tells */
+/* whether it is valid. Calls come from several threads at the same time. */
+typedef void (*JPEG_BATCH_CALLBACK)(int index, JPEG_FILE* jfile, void* user_data);
+
 /* * * * * * * * * * * * * * * * * * * * * * * * */
 /* here are the interface functions for JPEG IO  */
 /* * * * * * * * * * * * * * * * * * * * * * * * */
@@ -217,8 +444,28 @@ jpeg_read: read and decode a JPEG image file.
 * If loading success, "is_valid" will be set to true, and
 "image_data" contains the decoded raw image data (RGB).
 
-* now the program can only read baseline JPEGs, progressive JPEGs
-  are not supported.
+* baseline and progressive JPEGs can be read. The scans of a
+  progressive JPEG are accumulated before the image is output, set
+  option.scan_callback to get a preview after each scan. If the data
+  ends in the middle of a progressive JPEG, the image is decoded from
+  the scans received and "message" tells it is incomplete.
+
+* "option" controls how the image is decoded, pass NULL to use the
+  default options (see JPEG_READ_OPTION).
+
+* to decode into your own memory (e.g. interleaved RGBA with a row
+  pitch), set option.output:
+
+    JPEG_PIXEL_BUFFER buffer;
+    buffer.format = JPEG_PIXEL_RGBA;
+    buffer.data[0] = pixels;
+    buffer.stride = pitch;
+    buffer.width = max_width;
+    buffer.height = max_height;
+
+    JPEG_READ_OPTION option;
+    option.output = &buffer;
+    JPEG_FILE* jfile = jpeg_read("example.jpg", &option);
 
 * example:
 
@@ -233,7 +480,224 @@ jpeg_read: read and decode a JPEG image file.
         ...
     }
 */
-JPEG_API JPEG_FILE* jpeg_read(const char* file);
+JPEG_API JPEG_FILE* jpeg_read(const char* file, JPEG_READ_OPTION* option = NULL);
+/*
+jpeg_read_memory: decode a JPEG image that is already in memory
+(e.g. downloaded from network or object storage).
+
+* "data" and "size" give the content of a JPEG file, markers are
+  parsed directly from this buffer and nothing is written to disk.
+* the buffer can be released as soon as the function returns.
+* returns NULL if the arguments are invalid or out of memory,
+  otherwise check "is_valid" as with jpeg_read().
+*/
+JPEG_API JPEG_FILE* jpeg_read_memory(const void* data, int size, JPEG_READ_OPTION* option = NULL);
+/*
+jpeg_read_mmap: same as jpeg_read(), but the file is memory mapped
+instead of being copied into a buffer.
+*/
+JPEG_API JPEG_FILE* jpeg_read_mmap(const char* file, JPEG_READ_OPTION* option = NULL);
+/*
+jpeg_read_batch: decode many images with a pool of "num_threads" threads
+(0: one per CPU core).
+
+* the images are read from files or memory (see JPEG_BATCH_INPUT) and
+  each one is decoded by a single thread. The threads keep their buffers
+  between images, which saves most of the setup cost of calling
+  jpeg_read() for every small image.
+* "option" applies to every image (NULL: default options), except
+  "num_threads" and "output".
+* results are delivered through the completion array "results" (count
+  JPEG_FILE pointers, to be released with jpeg_free()), or through
+  "callback", or both. Without "results", the JPEG_FILE given to the
+  callback is only valid during the call, and its "image_data" is
+  released afterwards unless the callback sets it to NULL.
+* returns true if every image is successfully decoded.
+* example:
+
+    JPEG_BATCH_INPUT inputs[2];
+    inputs[0].file = "a.jpg";
+    inputs[1].data = buffer;
+    inputs[1].size = buffer_size;
+
+    JPEG_FILE* results[2];
+    jpeg_read_batch(inputs, 2, 0, NULL, results);
+    ...
+    jpeg_free(results[0]);
+    jpeg_free(results[1]);
+*/
+JPEG_API bool jpeg_read_batch(JPEG_BATCH_INPUT* inputs, int count, int num_threads, JPEG_READ_OPTION* option,
+    JPEG_FILE** results, JPEG_BATCH_CALLBACK callback = NULL, void* user_data = NULL);
+/*
+jpeg_create_decoder: create a decoder that keeps its memory and tables
+from one image to the next, for decoding many images in a row.
+
+* "option" applies to every image decoded (NULL: default options),
+  except "output".
+* jpeg_decode_into() decodes an image held in memory into "output" and
+  returns false on error. The coefficient and sample buffers of the
+  decoder only grow: once they fit the images, decoding allocates no
+  memory (only the extra threads are created when num_threads is not
+  1 and the image has restart markers). Quantization tables identical
+  to those of the previous image are not prepared again.
+* built Huffman tables are shared by all images and threads, an image
+  using the same tables as a previous one (e.g. the standard tables of
+  the JPEG specification) does not build them again.
+* jpeg_decoder_file() returns the headers of the last image (size,
+  channels) and the error message, the JPEG_FILE belongs to the
+  decoder and has no "image_data".
+* a decoder must not be used by several threads at the same time.
+* example:
+
+    JPEG_DECODER* decoder = jpeg_create_decoder();
+    for (...) {
+        if (!jpeg_decode_into(decoder, data, size, &buffer))
+            printf("error: %s\n", jpeg_decoder_file(decoder)->message);
+    }
+    jpeg_free_decoder(decoder);
+*/
+JPEG_API JPEG_DECODER* jpeg_create_decoder(JPEG_READ_OPTION* option = NULL);
+JPEG_API bool jpeg_decode_into(JPEG_DECODER* decoder, const void* data, int size, JPEG_PIXEL_BUFFER* output);
+/*
+jpeg_decode_file_into: same as jpeg_decode_into(), for a JPEG file.
+*/
+JPEG_API bool jpeg_decode_file_into(JPEG_DECODER* decoder, const char* file, JPEG_PIXEL_BUFFER* output);
+JPEG_API JPEG_FILE* jpeg_decoder_file(JPEG_DECODER* decoder);
+JPEG_API void jpeg_free_decoder(JPEG_DECODER* decoder);
+/*
+jpeg_create_stream_decoder: create a decoder for an image that arrives
+piece by piece (network, pipe), rows are output as soon as the data
+they depend on is received instead of after the whole file.
+
+* jpeg_stream_feed() appends the next bytes received (copied), and
+  jpeg_stream_step() decodes what it can and tells what happened:
+  JPEG_STREAM_HEADER once the size of the image is known (the output
+  buffer can be given at that point with jpeg_stream_set_output()),
+  JPEG_STREAM_ROWS when more rows are complete (jpeg_stream_rows()),
+  JPEG_STREAM_DONE at the end of the image, JPEG_STREAM_NEED_DATA when
+  it waits for more data, or JPEG_STREAM_ERROR.
+* the markers, the bit reader and the DC predictions are kept between
+  calls, nothing is decoded twice except an MCU cut by the end of the
+  data, which is only decoded again once the data of a few more MCUs has
+  been fed (feeding a byte at a time costs little more than feeding the
+  whole file). The data already decoded is dropped from the decoder.
+* baseline images are output row of MCUs by row of MCUs, with a single
+  thread. The scans of progressive images are decoded as they arrive and
+  the image is output at the end (option.scan_callback gives a preview
+  after each scan).
+* jpeg_stream_file() gives the headers, "image_data" (when there is no
+  output buffer) and the message.
+* example:
+
+    JPEG_STREAM_DECODER* decoder = jpeg_create_stream_decoder();
+    int status = JPEG_STREAM_NEED_DATA;
+    while (status != JPEG_STREAM_DONE && status != JPEG_STREAM_ERROR) {
+        if (status == JPEG_STREAM_NEED_DATA) {
+            size = receive(data);
+            jpeg_stream_feed(decoder, data, size);
+        }
+        status = jpeg_stream_step(decoder);
+        if (status == JPEG_STREAM_ROWS)
+            paint(jpeg_stream_file(decoder)->image_data, jpeg_stream_rows(decoder));
+    }
+    jpeg_free_stream_decoder(decoder);
+*/
+JPEG_API JPEG_STREAM_DECODER* jpeg_create_stream_decoder(JPEG_READ_OPTION* option = NULL);
+JPEG_API bool jpeg_stream_feed(JPEG_STREAM_DECODER* decoder, const void* data, int size);
+/*
+jpeg_stream_set_output: decode into "output" (see JPEG_READ_OPTION::output),
+or into "image_data" if NULL, instead of what option.output said at creation.
+
+* can be called until the step that follows JPEG_STREAM_HEADER, which reads
+  "output", returns false afterwards. The pixels must stay valid until the
+  decoder is freed.
+*/
+JPEG_API bool jpeg_stream_set_output(JPEG_STREAM_DECODER* decoder, JPEG_PIXEL_BUFFER* output);
+JPEG_API int jpeg_stream_step(JPEG_STREAM_DECODER* decoder);
+JPEG_API int jpeg_stream_rows(JPEG_STREAM_DECODER* decoder);
+JPEG_API JPEG_FILE* jpeg_stream_file(JPEG_STREAM_DECODER* decoder);
+JPEG_API void jpeg_free_stream_decoder(JPEG_STREAM_DECODER* decoder);
+/*
+jpeg_read_coefficients: read the quantized DCT coefficients of a JPEG
+image file for DCT-domain processing, nothing is dequantized or
+transformed back to pixels.
+
+* returns one plane of int16 coefficients per component, in block
+  order, with the quantization tables and the sampling layout (see
+  JPEG_COEFFICIENTS). Returns NULL if the file does not exist or out
+  of memory, otherwise check "is_valid".
+* the scans of a progressive JPEG are merged, the coefficients are the
+  same as those of the baseline image (which jpeg_write_coefficients()
+  writes).
+* the result is released with jpeg_free_coefficients().
+*/
+JPEG_API JPEG_COEFFICIENTS* jpeg_read_coefficients(const char* file);
+/*
+jpeg_read_coefficients_memory: same as jpeg_read_coefficients(), for a
+JPEG file in memory.
+*/
+JPEG_API JPEG_COEFFICIENTS* jpeg_read_coefficients_memory(const void* data, int size);
+JPEG_API void jpeg_free_coefficients(JPEG_COEFFICIENTS* coeffs);
+/*
+jpeg_transform_coefficients: rotate, flip or transpose the coefficients
+in place, "transform" is one of JPEG_TRANSFORM_*.
+
+* blocks are moved and the signs of odd frequencies flipped, the
+  coefficients themselves are not changed, so the transform is lossless.
+* like "jpegtran -trim", a flip drops the partial MCU at the right
+  (bottom) edge of the image, which cannot be moved to the left (top).
+* returns false, with the reason in coeffs->message, if the transform
+  flips an image narrower (shorter) than one MCU (8 or 16 pixels) in
+  that direction: nothing would remain after trimming, and the partial
+  MCU cannot be mirrored losslessly. The coefficients are unchanged, so
+  such a small image can be decoded and rotated with the pixels instead.
+*/
+JPEG_API bool jpeg_transform_coefficients(JPEG_COEFFICIENTS* coeffs, int transform);
+/*
+jpeg_write_coefficients: save coefficients as a baseline JPEG file, with
+optimal Huffman tables (luminance and chrominance tables). APPn and COM
+markers (EXIF, ...) are not written.
+*/
+JPEG_API bool jpeg_write_coefficients(JPEG_COEFFICIENTS* coeffs, const char* file);
+/*
+jpeg_transform: rotate or flip a JPEG image file without decoding it
+(jpeg_read_coefficients(), jpeg_transform_coefficients() and
+jpeg_write_coefficients()), the image quality is not altered.
+
+* returns false and does not write "dst" if the transform cannot be done
+  losslessly (a flip of an image smaller than one MCU, see
+  jpeg_transform_coefficients()).
+* example: applying the EXIF orientation 6
+
+    jpeg_transform("photo.jpg", "upright.jpg", JPEG_TRANSFORM_ROT_90);
+*/
+JPEG_API bool jpeg_transform(const char* src, const char* dst, int transform);
+/*
+jpeg_optimize: losslessly recompress a JPEG image file with Huffman
+tables computed for its own coefficients, instead of the generic tables
+of the JPEG standard that most encoders use (typically 5~10% smaller).
+
+* only the entropy coding is redone, the image is bit-exact and the
+  APPn and COM markers (EXIF, ICC profile, ...) are kept.
+* "dst" can be the same file as "src".
+* "dst" is never larger than "src": when there is no gain (already
+  optimized or progressive source), "src" is copied as is.
+*/
+JPEG_API bool jpeg_optimize(const char* src, const char* dst);
+/*
+jpeg_probe: read the headers of a JPEG image file without decoding it.
+
+* the markers are parsed until the start of scan (SOS) header, the
+  entropy-coded data that follows is never read.
+* returns false if the file cannot be opened, or if the headers are
+  invalid or describe an image that jpeg_read() cannot decode, the
+  reason is in info->message.
+*/
+JPEG_API bool jpeg_probe(const char* file, JPEG_INFO* info);
+/*
+jpeg_probe_memory: same as jpeg_probe(), for a JPEG file in memory.
+*/
+JPEG_API bool jpeg_probe_memory(const void* data, int size, JPEG_INFO* info);
 /*
 jpeg_free: unload a JPEG file.
 */